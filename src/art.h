@@ -31,9 +31,25 @@
 # define SCREEN_HEIGHT    768
 #endif
 
+/** 
+ * A framebuffer that the software renderer draws into.
+ * It contains SCREEN_HEIGHT rows of SCREEN_WIDTH pixels, in 0xRRGGBB format.
+ */
+struct render_target {
+    uint32_t * pixels;
+    render_target() : pixels(NULL) {}
+    virtual ~render_target() {}
+    virtual void clear(uint32_t color) = 0;
+    virtual void flip() = 0;
+};
+
+extern render_target * screen;
+
 void init_screen(const char * caption);
+void init_headless(); // In-memory framebuffer, does not require a display.
 void clear_creen();
 void flip_screen();
+void save_screen(const char * filename); // Writes .png or .ppm
 
 void pixel(uint32_t x, uint32_t y, uint32_t c); // SDL (Software)
 
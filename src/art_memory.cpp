@@ -0,0 +1,160 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "art.h"
+
+namespace {
+    /**
+     * Framebuffer that only lives in memory.
+     * Used to render on machines without a display, for example for benchmarking.
+     */
+    struct memory_target : public render_target {
+        memory_target() {
+            pixels = new uint32_t[SCREEN_WIDTH*SCREEN_HEIGHT];
+        }
+        ~memory_target() {
+            delete[] pixels;
+        }
+        void clear(uint32_t color) {
+            std::fill(pixels, pixels+SCREEN_WIDTH*SCREEN_HEIGHT, color);
+        }
+        void flip() {}
+    };
+
+    uint32_t crc_table[256];
+
+    uint32_t crc(uint32_t c, const uint8_t * data, uint32_t length) {
+        if (!crc_table[1]) {
+            for (uint32_t n=0; n<256; n++) {
+                uint32_t v = n;
+                for (int k=0; k<8; k++) v = v&1 ? 0xedb88320 ^ (v>>1) : v>>1;
+                crc_table[n] = v;
+            }
+        }
+        c = ~c;
+        for (uint32_t i=0; i<length; i++) c = crc_table[(c ^ data[i]) & 0xff] ^ (c>>8);
+        return ~c;
+    }
+
+    void put32(uint8_t * p, uint32_t v) {
+        p[0]=v>>24; p[1]=v>>16; p[2]=v>>8; p[3]=v;
+    }
+
+    void chunk(FILE * f, const char * type, const uint8_t * data, uint32_t length) {
+        uint8_t head[8];
+        put32(head, length);
+        memcpy(head+4, type, 4);
+        uint8_t tail[4];
+        put32(tail, crc(crc(0, head+4, 4), data, length));
+        fwrite(head, 8, 1, f);
+        if (length) fwrite(data, length, 1, f);
+        fwrite(tail, 4, 1, f);
+    }
+
+    /**
+     * Writes the screen as PNG.
+     * The image data is stored using uncompressed deflate blocks,
+     * such that no compression library is required.
+     */
+    void save_png(FILE * f) {
+        static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        fwrite(signature, 8, 1, f);
+
+        uint8_t header[13] = {};
+        put32(header, SCREEN_WIDTH);
+        put32(header+4, SCREEN_HEIGHT);
+        header[8] = 8; // bit depth
+        header[9] = 2; // truecolor
+        chunk(f, "IHDR", header, 13);
+
+        // Every row is a deflate block containing the filter type and the RGB values.
+        const uint32_t row = 1 + SCREEN_WIDTH*3;
+        const uint32_t block = 5 + row;
+        const uint32_t size = 2 + block*SCREEN_HEIGHT + 4;
+        uint8_t * data = new uint8_t[size];
+        uint8_t * p = data;
+        *p++ = 0x78;
+        *p++ = 0x01;
+        uint32_t a = 1, b = 0;
+        for (int y=0; y<SCREEN_HEIGHT; y++) {
+            *p++ = y==SCREEN_HEIGHT-1;
+            *p++ = (uint8_t)(row);
+            *p++ = (uint8_t)(row>>8);
+            *p++ = (uint8_t)(~row);
+            *p++ = (uint8_t)(~row>>8);
+            uint8_t * q = p;
+            *p++ = 0;
+            for (int x=0; x<SCREEN_WIDTH; x++) {
+                uint32_t c = screen->pixels[x+y*SCREEN_WIDTH];
+                *p++ = c>>16;
+                *p++ = c>>8;
+                *p++ = c;
+            }
+            for (; q<p; q++) {
+                a = (a + *q) % 65521;
+                b = (b + a) % 65521;
+            }
+        }
+        put32(p, b<<16 | a);
+        chunk(f, "IDAT", data, size);
+        delete[] data;
+        chunk(f, "IEND", NULL, 0);
+    }
+
+    /** Writes the screen as binary PPM. */
+    void save_ppm(FILE * f) {
+        fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+        uint8_t row[SCREEN_WIDTH*3];
+        for (int y=0; y<SCREEN_HEIGHT; y++) {
+            for (int x=0; x<SCREEN_WIDTH; x++) {
+                uint32_t c = screen->pixels[x+y*SCREEN_WIDTH];
+                row[x*3+0] = c>>16;
+                row[x*3+1] = c>>8;
+                row[x*3+2] = c;
+            }
+            fwrite(row, sizeof(row), 1, f);
+        }
+    }
+}
+
+void init_headless() {
+    screen = new memory_target();
+}
+
+/**
+ * Writes the contents of the screen to the given file.
+ * The file is written as PNG if its name ends in '.png' and as PPM otherwise.
+ */
+void save_screen(const char * filename) {
+    FILE * f = fopen(filename, "wb");
+    if (!f) {perror("Could not create image file"); exit(1);}
+    int length = strlen(filename);
+    if (length>=4 && strcmp(filename+length-4, ".png")==0) {
+        save_png(f);
+    } else {
+        save_ppm(f);
+    }
+    fclose(f);
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
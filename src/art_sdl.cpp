@@ -9,12 +9,19 @@ using glm::max;
 
 namespace {
   // The screen surface
-  SDL_Surface *screen = NULL;
-  
-  // pointer to the pixels (32 bit)
-  int * pixs;
+  struct sdl_target : public render_target {
+    SDL_Surface * surface;
+    void clear(uint32_t color) {
+      SDL_FillRect(surface,NULL,color);
+    }
+    void flip() {
+      SDL_Flip(surface);
+    }
+  };
 }
 
+render_target * screen = NULL;
+
 void init_screen(const char * caption) {
     // Initialize SDL 
     if (SDL_Init (SDL_INIT_VIDEO) < 0) {
@@ -28,29 +35,31 @@ void init_screen(const char * caption) {
 #endif
 
     // Set 32-bits video mode (eventually emulated)
-    screen = SDL_SetVideoMode (SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_SWSURFACE | SDL_DOUBLEBUF | (SCREEN_FULLSCREEN*SDL_FULLSCREEN));
-    if (screen == NULL) {
+    sdl_target * target = new sdl_target();
+    target->surface = SDL_SetVideoMode (SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_SWSURFACE | SDL_DOUBLEBUF | (SCREEN_FULLSCREEN*SDL_FULLSCREEN));
+    if (target->surface == NULL) {
         fprintf (stderr, "Couldn't set video mode: %s\n", SDL_GetError ());
         exit (3);
     }
     SDL_WM_SetCaption (caption, NULL);
 
     // set the pixel pointer
-    pixs=(int*)screen->pixels;  
+    target->pixels=(uint32_t*)target->surface->pixels;  
+    screen = target;
 }
 
 void clear_creen() {
-    SDL_FillRect(screen,NULL,0xaaccff);
+    screen->clear(0xaaccff);
 }
 
 void flip_screen() {
-    SDL_Flip (screen);
+    screen->flip();
 }
 
 void pixel(uint32_t x, uint32_t y, uint32_t c) {
     if (x<SCREEN_WIDTH && y<SCREEN_HEIGHT) {
         int64_t i = x+y*(SCREEN_WIDTH);
-        pixs[i] = c;
+        screen->pixels[i] = c;
     } else abort();
 }
 
@@ -22,6 +22,7 @@
 #include <cassert>
 #include <algorithm>
 #include <cstring>
+#include <unistd.h>
 
 #include <map>
 #include <string>
@@ -30,16 +31,18 @@
 #include "events.h"
 #include "art.h"
 #include "octree.h"
+#include "scene.h"
+#include "render_options.h"
 
 using namespace std;
 
-struct Scene {
+struct View {
     const char * filename;
     glm::dvec3 position;
     glm::dmat3 orientation;
 };
 
-const static Scene scene [] = {
+const static View view [] = {
     {"sibenik",  glm::dvec3(         0,          0,          0)/4.0,  glm::dmat3(-0.119, -0.430, -0.895,   0.249,  0.860, -0.446,   0.961, -0.275,  0.005)},
     {"sibenik",  glm::dvec3( -12398374,   -8116292,    2362616)/4.0,  glm::dmat3(-0.275,  0.188,  0.943,   0.091,  0.981, -0.170,  -0.957,  0.039, -0.286)},
     {"sibenik",  glm::dvec3(  13429612,   -8589723,     711460)/4.0,  glm::dmat3(-0.231, -0.166, -0.959,  -0.815,  0.572,  0.097,   0.532,  0.803, -0.267)},
@@ -56,35 +59,63 @@ const static Scene scene [] = {
     {"sponge",   glm::dvec3(-105770856, -141629176,  214304513)/4.0,  glm::dmat3( 0.617, -0.780,  0.105,  -0.629, -0.569, -0.529,   0.472,  0.261, -0.842)},
     {"sponge",   glm::dvec3(-106040634, -140228475,  218791417)/4.0,  glm::dmat3(-0.211, -0.750,  0.627,  -0.848,  0.460,  0.265,  -0.487, -0.475, -0.733)},
 };
-const static int scenes = sizeof(scene)/sizeof(scene[0]);
+const static int views = sizeof(view)/sizeof(view[0]);
 const static int N = 5;
-double results[scenes];
+double results[views];
+double load[views];
+double cold[views];
 ///////////////////////////////////////////////////////////////////////////////
-int main() {
-    init_screen("Voxel renderer - benchmark");
+int main(int argc, char *argv[]) {
+    render_options options;
+    if (render_parse_options(argc, argv, options) != argc) {
+        fprintf(stderr,"The benchmark does not take arguments besides options.\n");
+        exit(2);
+    }
+    
+    if (options.headless) {
+        init_headless();
+    } else {
+        init_screen("Voxel renderer - benchmark");
+    }
     
     // mainloop
-    for (int i=0; i<scenes; i++) {
-        char infile[32];
-        sprintf(infile, "vxl/%s.oct", scene[i].filename);
-        octree_file in(infile);
-        position = scene[i].position;
-        orientation = scene[i].orientation;
+    for (int i=0; i<views; i++) {
+        uint64_t hits, misses;
+        render_cache_stats(hits, misses);
+        Timer t_load;
+        scene * world = render_load(view[i].filename, options);
+        load[i] = t_load.elapsed();
+        position = view[i].position;
+        orientation = view[i].orientation;
         double times[N];
         for (int j=-1; j<N; j++) {
             Timer t;
             clear_creen();
-            octree_draw(&in);
+            octree_draw(*world);
             flip_screen();
             if (j>=0) {
                 times[j] = t.elapsed();
-                next_frame(times[j]);
+                if (!options.headless) next_frame(times[j]);
+            } else {
+                cold[i] = t.elapsed();
             }
         }
-        printf("Test %2d:", i);
+        if (options.image) {
+            char imagefile[strlen(options.image)+8];
+            sprintf(imagefile, "%s%02d.ppm", options.image, i);
+            save_screen(imagefile);
+        }
+        printf("Test %2d: %7.2f %7.2f |", i, load[i], cold[i]);
         for (int j=0; j<N; j++) {
             printf(" %7.2f", times[j]);
         }
+        if (world->files[0]->format == OCTREE_PACKED) {
+            uint64_t new_hits, new_misses;
+            render_cache_stats(new_hits, new_misses);
+            hits = new_hits - hits;
+            misses = new_misses - misses;
+            printf(" | Cache hits: %6.2f%%", hits * 100.0 / (hits + misses));
+        }
         printf("\n");
         fflush(stdout);
         std::sort(times,times+N);
@@ -93,16 +124,25 @@ int main() {
             results[i] += times[j];
         }
         results[i] /= N-2;
-        handle_events();
+        delete world;
+        if (!options.headless) handle_events();
     }
 
-    printf("\nBenchmark results:");
+    printf("\nBenchmark results (%d threads):", render_threads);
     double sum = 0;
-    for (int i=0; i<scenes; i++) {
+    for (int i=0; i<views; i++) {
         printf(" %7.2f", results[i]);
         sum += results[i];
     }
-    printf(" | %7.2f\n", sum/scenes);
+    printf(" | %7.2f\n", sum/views);
+    
+    printf("First frame, including loading:");
+    sum = 0;
+    for (int i=0; i<views; i++) {
+        printf(" %7.2f", load[i] + cold[i]);
+        sum += load[i] + cold[i];
+    }
+    printf(" | %7.2f\n", sum/views);
     return 0;
 }
 
@@ -21,14 +21,21 @@
 #include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <functional>
+#include <vector>
+#include <unordered_map>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "pointset.h"
 #include "timing.h"
 #include "octree.h"
+#include "octree_pack.h"
+#include "octree_order.h"
+#include "color_mixer.h"
 
 /** Maximum allowed depth of octree
  * Note that the sorting procedure has a bound of 21 layers.
@@ -76,60 +83,422 @@ uint64_t hilbert3d( const point & p ) {
   return ret;
 }
     
-bool hilbert3d_compare( const point & p1,const point & p2 ) {
-  uint64_t val1 = morton3d( p1.x,p1.y,p1.z );
-  uint64_t val2 = morton3d( p2.x,p2.y,p2.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t rg1 = ((val1>>(3*j))&7) ^ start;
-    uint64_t rg2 = ((val2>>(3*j))&7) ^ start;
-    uint64_t i1 = (((rg1 << 3) | rg1) >> travel_shift ) & 7;
-    uint64_t i2 = (((rg2 << 3) | rg2) >> travel_shift ) & 7;
-    i1 = (0x54672310 >> i1*4) & 7;
-    i2 = (0x54672310 >> i2*4) & 7;
-    if (i1<i2) return true;
-    if (i1>i2) return false;
-    uint64_t si = (0x64422000 >> i1*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i1*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
+/** A point's position on the Hilbert curve and its index in the point set. */
+struct keyed_point {
+  uint64_t key;
+  uint64_t index;
+};
+
+/** Number of bits of the key that are sorted per pass of the radix sort. */
+static const int RADIX_BITS = 8;
+static const int RADIX = 1<<RADIX_BITS;
+
+/** The part of the points that is handled by one thread while sorting. */
+struct sort_job {
+  pthread_t thread;
+  const point * points;
+  keyed_point * from;
+  keyed_point * to;
+  uint64_t begin, end;
+  int shift;
+  uint64_t key_or, key_and;
+  uint64_t count[RADIX];
+};
+
+/** Computes the keys of the points of the job, and which bits differ between them. */
+void * compute_keys(void * arg) {
+  sort_job & job = *(sort_job*)arg;
+  job.key_or = 0;
+  job.key_and = ~0ull;
+  for (uint64_t i=job.begin; i<job.end; i++) {
+    uint64_t key = hilbert3d(job.points[i]);
+    job.from[i].key = key;
+    job.from[i].index = i;
+    job.key_or |= key;
+    job.key_and &= key;
   }
-  return false;
+  return NULL;
 }
 
-#define CLAMP(x,l,u) (x<l?l:x>u?u:x)
-uint32_t rgb(int32_t r, int32_t g, int32_t b) {
-  return CLAMP(r,0,255)<<16|CLAMP(g,0,255)<<8|CLAMP(b,0,255);
+/** Counts how often each digit of the current pass occurs in the part of the job. */
+void * count_digits(void * arg) {
+  sort_job & job = *(sort_job*)arg;
+  std::fill(job.count, job.count+RADIX, 0);
+  for (uint64_t i=job.begin; i<job.end; i++) {
+    job.count[job.from[i].key >> job.shift & (RADIX-1)]++;
+  }
+  return NULL;
 }
-uint32_t rgb(float r, float g, float b) {
-  return rgb((int32_t)(r+0.5),(int32_t)(g+0.5),(int32_t)(b+0.5));
+
+/** Moves the part of the job to the positions given by count, keeping the order of equal digits. */
+void * scatter_digits(void * arg) {
+  sort_job & job = *(sort_job*)arg;
+  for (uint64_t i=job.begin; i<job.end; i++) {
+    job.to[job.count[job.from[i].key >> job.shift & (RADIX-1)]++] = job.from[i];
+  }
+  return NULL;
 }
 
-uint32_t average(octree* root, int index) {
-  for (int i=0; i<8; i++) {
-    if(~root[index].child[i]) {
-      root[index].avgcolor[i] = average(root, root[index].child[i]);
+/** Copies the points in sorted order to the buffer to, which has the size of the keyed points. */
+void * gather_points(void * arg) {
+  sort_job & job = *(sort_job*)arg;
+  point * out = (point*)job.to;
+  for (uint64_t i=job.begin; i<job.end; i++) {
+    out[i] = job.points[job.from[i].index];
+  }
+  return NULL;
+}
+
+/** Runs the given function for every job, using a thread for each job. */
+template<typename J>
+void run_jobs(std::vector<J> & jobs, void * (*function)(void*)) {
+  for (unsigned int i=1; i<jobs.size(); i++) {
+    if (pthread_create(&jobs[i].thread, NULL, function, &jobs[i])) {
+      perror("Could not create thread");
+      exit(1);
     }
   }
-  float r=0, g=0, b=0;
-  int n=0;
-  for (int i=0; i<8; i++) {
-    if(root[index].avgcolor[i]>=0) {
-      int v = root[index].avgcolor[i];
-      r += (v&0xff0000)>>16;
-      g += (v&0xff00)>>8;
-      b += (v&0xff);
-      n++;
+  function(&jobs[0]);
+  for (unsigned int i=1; i<jobs.size(); i++) {
+    pthread_join(jobs[i].thread, NULL);
+  }
+}
+
+/** Sorts n points along the Hilbert curve, using the given number of threads.
+ * The key of every point is computed once, after which the keys and the indices of the points 
+ * are sorted by a least significant digit first radix sort. Passes over digits that are equal
+ * for all points are skipped. Finally, the points are copied in sorted order to one of the buffers,
+ * which both hold n keyed points, and a pointer to the sorted points is returned.
+ */
+point * sort_part(Timer & t, const point * points, uint64_t n, int threads, keyed_point * from, keyed_point * to) {
+  // The sorted points are gathered in the buffer of the keys.
+  assert(sizeof(keyed_point) == sizeof(point));
+  
+  std::vector<sort_job> jobs(std::max<uint64_t>(std::min<uint64_t>(threads, n/RADIX), 1));
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    jobs[i].points = points;
+    jobs[i].begin = n * i / jobs.size();
+    jobs[i].end = n * (i+1) / jobs.size();
+  }
+  
+  printf("[%10.0f] Computing keys using %lu threads.\n", t.elapsed(), jobs.size());
+  for (unsigned int i=0; i<jobs.size(); i++) jobs[i].from = from;
+  run_jobs(jobs, compute_keys);
+  uint64_t key_or = 0, key_and = ~0ull;
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    key_or |= jobs[i].key_or;
+    key_and &= jobs[i].key_and;
+  }
+  uint64_t differ = key_or ^ key_and;
+  
+  for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+    if (!(differ >> shift & (RADIX-1))) continue;
+    printf("[%10.0f] Sorting on bits %d-%d.\n", t.elapsed(), shift, shift+RADIX_BITS-1);
+    for (unsigned int i=0; i<jobs.size(); i++) {
+      jobs[i].from = from;
+      jobs[i].to = to;
+      jobs[i].shift = shift;
+    }
+    run_jobs(jobs, count_digits);
+    // Each thread writes its points with a digit after those of the previous threads with the same digit.
+    uint64_t offset = 0;
+    for (int d=0; d<RADIX; d++) {
+      for (unsigned int i=0; i<jobs.size(); i++) {
+        uint64_t c = jobs[i].count[d];
+        jobs[i].count[d] = offset;
+        offset += c;
+      }
+    }
+    run_jobs(jobs, scatter_digits);
+    std::swap(from, to);
+  }
+  
+  printf("[%10.0f] Reordering points.\n", t.elapsed());
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    jobs[i].from = from;
+    jobs[i].to = to;
+  }
+  run_jobs(jobs, gather_points);
+  return (point*)to;
+}
+
+/** Writes n points to the file at the given position, or exits if that fails. */
+void write_points(int fd, const point * points, uint64_t n, uint64_t position) {
+  const char * data = (const char*)points;
+  uint64_t size = n * sizeof(point);
+  uint64_t offset = position * sizeof(point);
+  while (size) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written <= 0) {perror("Could not write points"); exit(1);}
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+/** Reads n points from the file at the given position, or exits if that fails. */
+void read_points(int fd, point * points, uint64_t n, uint64_t position) {
+  char * data = (char*)points;
+  uint64_t size = n * sizeof(point);
+  uint64_t offset = position * sizeof(point);
+  while (size) {
+    ssize_t count = pread(fd, data, size, offset);
+    if (count <= 0) {perror("Could not read points"); exit(1);}
+    data += count;
+    size -= count;
+    offset += count;
+  }
+}
+
+/** A sorted run of points that is read in blocks while merging the runs. */
+struct run_reader {
+  uint64_t next, end; ///< Range of the points in the run file that have not been read yet.
+  std::vector<point> block;
+  uint64_t index, count; ///< Position of the current point in the block and the number of points in the block.
+};
+
+/** Sorts the points along the Hilbert curve, using the given number of threads.
+ * The sort requires 32 bytes of memory per point. If that exceeds the given amount of memory,
+ * the points are sorted in runs that fit in memory, which are written to the run file.
+ * These runs are merged afterwards, while the points are written back in sequential blocks.
+ * Points with equal keys keep their order in both cases.
+ */
+void sort_points(Timer & t, pointset & in, int threads, uint64_t memory, const char * runfile) {
+  uint64_t n = in.length;
+  // Runs consist of whole pages of points, such that these can be released once they are sorted.
+  uint64_t pagesize = getpagesize();
+  uint64_t run = std::max<uint64_t>(memory / (2*sizeof(keyed_point)), pagesize) / pagesize * pagesize;
+  if (n <= run) {
+    keyed_point * from = new keyed_point[n];
+    keyed_point * to = new keyed_point[n];
+    point * sorted = sort_part(t, in.list, n, threads, from, to);
+    in.enable_write(true);
+    memcpy((void*)in.list, sorted, n * sizeof(point));
+    in.enable_write(false);
+    delete[] from;
+    delete[] to;
+    return;
+  }
+  
+  uint64_t runs = (n + run - 1) / run;
+  printf("[%10.0f] Sorting %lu runs of at most %lu points, as they do not fit in %luMiB.\n", t.elapsed(), runs, run, memory>>20);
+  int fd = open(runfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {perror("Could not create run file"); exit(1);}
+  {
+    keyed_point * from = new keyed_point[run];
+    keyed_point * to = new keyed_point[run];
+    for (uint64_t r=0; r<runs; r++) {
+      uint64_t begin = r * run;
+      uint64_t length = std::min(n - begin, run);
+      printf("[%10.0f] Sorting run %lu of %lu.\n", t.elapsed(), r+1, runs);
+      point * sorted = sort_part(t, in.list + begin, length, threads, from, to);
+      write_points(fd, sorted, length, begin);
+      // The points of the run are not read again.
+      madvise(in.list + begin, length * sizeof(point), MADV_DONTNEED);
+    }
+    delete[] from;
+    delete[] to;
+  }
+  
+  // Merge the runs, using a block of memory for every run and one for the output.
+  printf("[%10.0f] Merging %lu runs.\n", t.elapsed(), runs);
+  uint64_t block = std::max<uint64_t>(memory / ((runs + 1) * sizeof(point)), pagesize);
+  std::vector<run_reader> readers(runs);
+  // The heap contains the key of the current point of each run, ordered by run for equal keys.
+  std::vector<std::pair<uint64_t, uint64_t> > heap;
+  for (uint64_t r=0; r<runs; r++) {
+    run_reader & reader = readers[r];
+    reader.next = r * run;
+    reader.end = std::min(n, reader.next + run);
+    reader.block.resize(block);
+    reader.count = std::min(block, reader.end - reader.next);
+    read_points(fd, &reader.block[0], reader.count, reader.next);
+    reader.next += reader.count;
+    reader.index = 0;
+    heap.push_back(std::make_pair(hilbert3d(reader.block[0]), r));
+  }
+  std::make_heap(heap.begin(), heap.end(), std::greater<std::pair<uint64_t, uint64_t> >());
+  std::vector<point> out(block);
+  uint64_t written = 0, buffered = 0;
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), std::greater<std::pair<uint64_t, uint64_t> >());
+    run_reader & reader = readers[heap.back().second];
+    out[buffered++] = reader.block[reader.index++];
+    if (buffered == block) {
+      write_points(in.fd, &out[0], buffered, written);
+      written += buffered;
+      buffered = 0;
+    }
+    if (reader.index == reader.count) {
+      if (reader.next == reader.end) {
+        heap.pop_back();
+        continue;
+      }
+      reader.count = std::min(block, reader.end - reader.next);
+      read_points(fd, &reader.block[0], reader.count, reader.next);
+      reader.next += reader.count;
+      reader.index = 0;
+    }
+    heap.back().first = hilbert3d(reader.block[reader.index]);
+    std::push_heap(heap.begin(), heap.end(), std::greater<std::pair<uint64_t, uint64_t> >());
+  }
+  write_points(in.fd, &out[0], buffered, written);
+  assert(written + buffered == n);
+  close(fd);
+  unlink(runfile);
+}
+
+/** Points at the same position, merged into the sums of their color channels and their number.
+ * The sums are those of the color_mixer, hence of the linear intensities if it averages in linear light.
+ */
+struct merged_point {
+  uint64_t key; ///< Morton code of the position, with the bits ordered as in the octree.
+  uint32_t count;
+  uint32_t sum[3];
+};
+
+/** Maximum number of points in a merged point, such that the sums of 16-bit linear intensities fit in 32 bits.
+ * Further points at the same position start another merged point with the same key.
+ */
+static const uint32_t MERGE_LIMIT = 1<<16;
+
+/** A part of the merged points, which were merged by one thread. */
+struct merged_part {
+  uint64_t begin; ///< Index of its first merged point.
+  int64_t maxnode; ///< Largest key of its merged points.
+  uint64_t nodecount[D]; ///< Number of nodes per layer that start in the part.
+};
+
+/** The part of the points that is checked, merged and counted by one thread, which starts at a new position. */
+struct merge_job {
+  pthread_t thread;
+  const point * points;
+  merged_point * voxels;
+  const color_mixer * mixer;
+  uint64_t begin, end;
+  uint64_t unsorted; ///< Index of the first point that should precede the previous point, or 0 if there is none.
+  uint64_t count; ///< Number of merged points, which are written from index begin on.
+  uint32_t bounds_min[3];
+  uint32_t bounds_max[3];
+  merged_part part;
+};
+
+/** Merges the consecutive points of the job at equal positions, determines the bounds of its points 
+ * and counts the nodes per layer that start in the part of the job.
+ * Stops at the first point that is not sorted, comparing the first point with the last point of the previous job.
+ */
+void * merge_points(void * arg) {
+  merge_job & job = *(merge_job*)arg;
+  job.unsorted = 0;
+  job.count = 0;
+  for (int j=0; j<3; j++) {job.bounds_min[j] = ~0u; job.bounds_max[j] = 0;}
+  job.part.maxnode = 0;
+  for (int j=0; j<D; j++) job.part.nodecount[j] = 0;
+  int64_t old = job.begin ? hilbert3d(job.points[job.begin-1]) : 0;
+  int64_t prev = -1;
+  if (job.begin) {
+    const point & q = job.points[job.begin-1];
+    prev = morton3d(q.z, q.y, q.x);
+  }
+  merged_point * v = NULL;
+  for (uint64_t i=job.begin; i<job.end; i++) {
+    const point & q = job.points[i];
+    int64_t cur = hilbert3d(q);
+    if (old>cur) {
+      job.unsorted = i;
+      break;
     }
+    old = cur;
+    assert(q.c<0x1000000);
+    job.bounds_min[0] = std::min(job.bounds_min[0], q.x); job.bounds_max[0] = std::max(job.bounds_max[0], q.x);
+    job.bounds_min[1] = std::min(job.bounds_min[1], q.y); job.bounds_max[1] = std::max(job.bounds_max[1], q.y);
+    job.bounds_min[2] = std::min(job.bounds_min[2], q.z); job.bounds_max[2] = std::max(job.bounds_max[2], q.z);
+    int64_t key = morton3d(q.z, q.y, q.x);
+    if (key != prev) {
+      for (int j=0; j<D; j++) {
+        if ((key>>j*3)!=(prev>>j*3)) job.part.nodecount[j]++;
+      }
+      job.part.maxnode = std::max(job.part.maxnode, key);
+      prev = key;
+    }
+    if (!v || (int64_t)v->key != key || v->count == MERGE_LIMIT) {
+      v = &job.voxels[job.begin + job.count++];
+      v->key = key;
+      v->count = 0;
+      v->sum[0] = v->sum[1] = v->sum[2] = 0;
+    }
+    uint64_t sum[3] = {0, 0, 0};
+    job.mixer->add(sum, q.c, 1);
+    for (int j=0; j<3; j++) v->sum[j] += sum[j];
+    v->count++;
+  }
+  return NULL;
+}
+
+/** Merges the points at equal positions, using the given number of threads, determines their bounds and 
+ * counts the nodes per layer in the parts that are merged by each thread.
+ * The merged points are written to voxels, which has room for every point. 
+ * Returns false if the points are not sorted, otherwise stores the number of merged points in count.
+ */
+bool merge_all(Timer & t, const pointset & in, int threads, const color_mixer & mixer, merged_point * voxels, uint64_t & count, uint32_t bounds_min[3], uint32_t bounds_max[3], std::vector<merged_part> & parts) {
+  std::vector<merge_job> jobs(std::max<uint64_t>(std::min<uint64_t>(threads, in.length>>16), 1));
+  uint64_t begin = 0;
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    jobs[i].points = in.list;
+    jobs[i].voxels = voxels;
+    jobs[i].mixer = &mixer;
+    jobs[i].begin = begin;
+    // Move the end of the part forward past the points at the position of its last point.
+    uint64_t end = std::max(begin, in.length * (i+1) / jobs.size());
+    while (end > 0 && end < in.length) {
+      const point & p = in.list[end-1];
+      const point & q = in.list[end];
+      if (p.x != q.x || p.y != q.y || p.z != q.z) break;
+      end++;
+    }
+    jobs[i].end = begin = end;
+  }
+  
+  printf("[%10.0f] Checking, merging and counting %lu points using %lu threads.\n", t.elapsed(), in.length, jobs.size());
+  run_jobs(jobs, merge_points);
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    if (!jobs[i].unsorted) continue;
+    printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), jobs[i].unsorted);
+    return false;
   }
-  return rgb(r/n,g/n,b/n);
+  
+  // Move the merged points of each part directly after those of the previous parts.
+  count = 0;
+  parts.clear();
+  for (int j=0; j<3; j++) {bounds_min[j] = ~0u; bounds_max[j] = 0;}
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    memmove(&voxels[count], &voxels[jobs[i].begin], jobs[i].count * sizeof(merged_point));
+    jobs[i].part.begin = count;
+    parts.push_back(jobs[i].part);
+    count += jobs[i].count;
+    for (int j=0; j<3; j++) {
+      bounds_min[j] = std::min(bounds_min[j], jobs[i].bounds_min[j]);
+      bounds_max[j] = std::max(bounds_max[j], jobs[i].bounds_max[j]);
+    }
+  }
+  printf("[%10.0f] Merged the points at equal positions into %lu points.\n", t.elapsed(), count);
+  return true;
+}
+
+/** Maps a temporary file of the given size to memory, which is removed once it is unmapped, or exits if that fails. */
+void * map_temporary(const char * filename, uint64_t size) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {perror("Could not create temporary file"); exit(1);}
+  unlink(filename);
+  if (ftruncate(fd, size)) {perror("Could not resize temporary file"); exit(1);}
+  void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {perror("Could not map temporary file to memory"); exit(1);}
+  close(fd);
+  return data;
 }
 
-void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
+template<typename N>
+void replicate(N* root, uint64_t index, uint32_t mask, uint32_t depth) {
     if (depth<=0) return;
     for (uint32_t i=0; i<8; i++) {
         if (i == (i&mask)) {
@@ -141,15 +510,537 @@ void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
     }
 }
 
-void clear(octree& n) {
+template<typename N>
+void clear(N& n) {
   for (int i=0; i<8; i++) {
     n.avgcolor[i]=-1;
-    n.child[i]=~0u;
+    n.child[i]=-1; // ~0 for both 32 and 64-bit indices
+  }
+}
+
+template<typename N>
+uint32_t child_mask(const N& n) {
+  uint32_t mask = 0;
+  for (int i=0; i<8; i++) {
+    if (n.avgcolor[i]>=0) mask |= 1<<i;
+  }
+  return mask;
+}
+
+/** Returns the 64-bit FNV-1a hash of the contents of a node. */
+template<typename N>
+uint64_t node_hash(const N& n) {
+  const uint32_t * data = (const uint32_t *)&n;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i=0; i<sizeof(N)/4; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+/** Merges identical subtrees, turning the octree into a directed acyclic graph.
+ * The layers are processed bottom up, such that the children of a node are already merged 
+ * when it is compared with the other nodes of its layer. Afterwards, the remaining nodes 
+ * that are reachable from the root are moved to the front, keeping the layers in order, 
+ * and the file is shrunk. Returns the new number of nodes.
+ */
+template<typename N>
+uint64_t merge_subtrees(Timer& t, octree_file& out, int layers, int bottom_layer) {
+  N* root = (N*)out.root;
+  octree_header& header = *out.header;
+  uint64_t nodes = out.nodes();
+  
+  // Replace every node by the first identical node in its layer.
+  typedef std::unordered_multimap<uint64_t, uint64_t> map;
+  std::vector<uint64_t> remap(nodes);
+  for (int i=bottom_layer+1; i<=layers; i++) {
+    map seen;
+    uint64_t begin = header.layer_offset[i];
+    uint64_t end = begin + header.layer_count[i];
+    for (uint64_t j=begin; j<end; j++) {
+      N& n = root[j];
+      for (int k=0; k<8; k++) {
+        if (~n.child[k]) n.child[k] = remap[n.child[k]];
+      }
+      uint64_t hash = node_hash(n);
+      remap[j] = j;
+      std::pair<map::iterator, map::iterator> range = seen.equal_range(hash);
+      for (map::iterator it = range.first; it != range.second; ++it) {
+        if (memcmp(&root[it->second], &n, sizeof(N)) == 0) {
+          remap[j] = it->second;
+          break;
+        }
+      }
+      if (remap[j] == j) seen.insert(std::make_pair(hash, j));
+    }
+    printf("[%10.0f] Layer %2d: %8lu of %8lu nodes are unique.\n", t.elapsed(), i, seen.size(), end - begin);
+  }
+  
+  // Assign new indices to the nodes that are still reachable, in order.
+  // As children are stored after their parents, a single pass suffices.
+  std::vector<uint64_t> index(nodes, ~0ull);
+  index[0] = 0;
+  uint64_t count = 0;
+  for (int i=layers; i>bottom_layer; i--) {
+    uint64_t begin = header.layer_offset[i];
+    uint64_t end = begin + header.layer_count[i];
+    header.layer_offset[i] = count;
+    for (uint64_t j=begin; j<end; j++) {
+      if (remap[j] != j || !~index[j]) continue;
+      index[j] = count++;
+      N& n = root[j];
+      for (int k=0; k<8; k++) {
+        if (~n.child[k]) index[n.child[k]] = 0;
+      }
+    }
+    header.layer_count[i] = count - header.layer_offset[i];
+  }
+  
+  // Move the nodes, which only moves nodes towards the front.
+  for (uint64_t j=0; j<nodes; j++) {
+    if (remap[j] != j || !~index[j]) continue;
+    N n = root[j];
+    for (int k=0; k<8; k++) {
+      if (~n.child[k]) n.child[k] = index[n.child[k]];
+    }
+    root[index[j]] = n;
+  }
+  out.shrink(count*sizeof(N));
+  return count;
+}
+
+/** Writes the octree in the compact format.
+ * The children of each node are assigned consecutive indices in breadth first order.
+ * Nodes that are shared, as a result of replication, are written only once.
+ * Returns false if the octree is too large for the compact format, in which case an existing file is removed.
+ */
+template<typename N>
+bool write_compact(N* root, uint64_t nodes, uint32_t color, const octree_header& header, const char * filename) {
+  // Assign the index of the first child to every reachable node.
+  std::vector<uint64_t> first(nodes, ~0ull);
+  std::vector<uint64_t> order;
+  uint64_t size = 1;
+  first[0] = size;
+  size += __builtin_popcount(child_mask(root[0]));
+  order.push_back(0);
+  for (uint64_t j=0; j<order.size(); j++) {
+    N& n = root[order[j]];
+    for (int i=0; i<8; i++) {
+      if (n.avgcolor[i]>=0 && ~n.child[i] && first[n.child[i]]==~0ull) {
+        first[n.child[i]] = size;
+        size += __builtin_popcount(child_mask(root[n.child[i]]));
+        order.push_back(n.child[i]);
+      }
+    }
+  }
+  
+  if (size > 0xffffffffu) {
+    fprintf(stderr, "The octree is too large for the compact format.\n");
+    unlink(filename);
+    return false;
+  }
+  octree_file out(filename, size*sizeof(compact_octree), OCTREE_COMPACT);
+  out.header->depth = header.depth;
+  out.header->bottom_layer = header.bottom_layer;
+  out.header->mix = header.mix;
+  memcpy(out.header->bounds, header.bounds, sizeof(header.bounds));
+  compact_octree * c = out.compact_root;
+  c[0].child = first[0];
+  c[0].data = color | child_mask(root[0])<<24;
+  for (uint64_t j=0; j<order.size(); j++) {
+    N& n = root[order[j]];
+    compact_octree * next = &c[first[order[j]]];
+    for (int i=0; i<8; i++) {
+      if (n.avgcolor[i]<0) continue;
+      if (~n.child[i]) {
+        next->child = first[n.child[i]];
+        next->data = n.avgcolor[i] | child_mask(root[n.child[i]])<<24;
+      } else {
+        next->child = 0;
+        next->data = n.avgcolor[i];
+      }
+      next++;
+    }
+  }
+  return true;
+}
+
+/** Converts a 24-bit RGB color to 16-bit RGB565. */
+uint16_t rgb565(uint32_t c) {
+  uint32_t r = ((c>>16&0xff)*31+127)/255;
+  uint32_t g = ((c>>8&0xff)*63+127)/255;
+  uint32_t b = ((c&0xff)*31+127)/255;
+  return r<<11 | g<<5 | b;
+}
+
+/** Writes the octree in the split format, with the colors stored apart from the nodes.
+ * If bits is 16, the colors are reduced to RGB565.
+ */
+void write_split(const octree * root, uint64_t nodes, int bits, const octree_header& header, const char * filename) {
+  octree_format format = bits == 16 ? OCTREE_SPLIT16 : OCTREE_SPLIT;
+  octree_file out(filename, nodes*octree_file::node_size(format), format);
+  memcpy(out.header, &header, sizeof(octree_header));
+  out.header->format = format;
+  out.header->nodes = nodes;
+  split_octree * s = out.split_root;
+  uint32_t * colors = (uint32_t *)out.split_colors();
+  uint16_t * colors16 = (uint16_t *)out.split_colors();
+  for (uint64_t j=0; j<nodes; j++) {
+    for (int i=0; i<8; i++) {
+      int32_t color = root[j].avgcolor[i];
+      s[j].child[i] = color < 0 ? SPLIT_EMPTY : root[j].child[i];
+      if (color < 0) color = 0;
+      if (format == OCTREE_SPLIT16) {
+        colors16[j*8+i] = rgb565(color);
+      } else {
+        colors[j*8+i] = color;
+      }
+    }
+  }
+}
+
+/** Not used, as main rejects split files with 64-bit child indices before the octree is built. */
+void write_split(const wide_octree *, uint64_t, int, const octree_header &, const char *) {
+  assert(!"Split files with 64-bit child indices are not supported.");
+}
+
+/** Not used, as main rejects packed files with 64-bit child indices before the octree is built. */
+void write_packed(const wide_octree *, uint64_t, const octree_header &, const char *) {
+  assert(!"Packed files with 64-bit child indices are not supported.");
+}
+
+/** The nodes that contain the current point while the sorted points are stored, one for each layer.
+ * The number of points in each of their children is counted as well, which is used to
+ * weigh the average colors if the mixer is weighted.
+ */
+template<typename N>
+struct open_nodes {
+  std::vector<N> node;
+  std::vector<uint64_t> weight;
+  const color_mixer & mixer;
+  /** Opens an empty node for the layers from lowest up to and including highest. */
+  open_nodes(int lowest, int highest, const color_mixer & mixer) : node(highest+1), weight(8*(highest+1)), mixer(mixer) {
+    for (int j=lowest; j<=highest; j++) clear(node[j]);
+  }
+  /** Stores a child in the node of the given layer above it. val is the Morton code of one of the points of the child. */
+  void set(int layer, uint64_t val, uint64_t child, int32_t color, uint64_t points) {
+    int idx = (val >> (layer-1)*3)&7;
+    node[layer].child[idx] = child;
+    node[layer].avgcolor[idx] = color;
+    weight[layer*8+idx] = points;
+  }
+  uint32_t color(int layer) const {
+    return mixer.average(node[layer], &weight[layer*8]);
+  }
+  /** Returns the number of points in the node of the given layer. */
+  uint64_t count(int layer) const {
+    uint64_t sum = 0;
+    for (int i=0; i<8; i++) if (node[layer].avgcolor[i]>=0) sum += weight[layer*8+i];
+    return sum;
+  }
+  /** Writes the node of the given layer at the next index of that layer, stores its index and
+   * average color in its parent and clears it for the next node. val is the Morton code of one of its points.
+   */
+  void close(N* root, int layer, uint64_t val, uint64_t* offset) {
+    uint64_t index = offset[layer]++;
+    root[index] = node[layer];
+    set(layer+1, val, index, color(layer), count(layer));
+    clear(node[layer]);
+  }
+};
+
+/** A complete cell of the split layer, as it is stored in its parent. */
+struct split_cell {
+  uint64_t val; ///< Morton code of one of its points.
+  uint64_t child;
+  int32_t color;
+  uint64_t count; ///< Number of points in the cell.
+};
+
+/** The part of the merged points that is stored by one thread. 
+ * It consists of whole cells of the split layer, such that the nodes below the split layer can be built
+ * independently of the other parts. The nodes of each layer are written after those of the previous parts.
+ */
+template<typename N>
+struct build_job {
+  pthread_t thread;
+  const merged_point * voxels;
+  N * root;
+  uint64_t begin, end;
+  int bottom_layer, split_layer;
+  const color_mixer * mixer;
+  uint64_t offset[D]; ///< Index of the next node of each layer.
+  std::vector<split_cell> cells;
+};
+
+/** Stores the nodes below the split layer of the part of the job and lists its cells of the split layer. 
+ * The cells are collected in a node of the layer above the split layer, which belongs to the shared top.
+ * Points in the same cell of the bottom layer are merged into a single voxel with their average color.
+ */
+template<typename N>
+void * build_cells(void * arg) {
+  build_job<N> & job = *(build_job<N>*)arg;
+  int b = job.bottom_layer;
+  int l = job.split_layer;
+  open_nodes<N> open(b+1, l+1, *job.mixer);
+  uint64_t prev = 0;
+  uint64_t sum[3] = {0, 0, 0}, count = 0;
+  for (uint64_t i=job.begin; i<=job.end; i++) {
+    bool last = i==job.end;
+    uint64_t val = last ? 0 : job.voxels[i].key;
+    if (i>job.begin && (last || (val>>b*3) != (prev>>b*3))) {
+      // The voxel of the previous point is complete.
+      open.set(b+1, prev, ~0ull, job.mixer->mix(sum, count), count);
+      sum[0] = sum[1] = sum[2] = count = 0;
+    }
+    if (i>job.begin && (last || (val>>l*3) != (prev>>l*3))) {
+      for (int j=b+1; j<=l; j++) {
+        open.close(job.root, j, prev, job.offset);
+      }
+      int idx = (prev >> l*3)&7;
+      split_cell c = {prev, open.node[l+1].child[idx], open.node[l+1].avgcolor[idx], open.weight[(l+1)*8+idx]};
+      job.cells.push_back(c);
+    } else {
+      for (int j=b+1; i>job.begin && j<l && (val>>j*3) != (prev>>j*3); j++) {
+        open.close(job.root, j, prev, job.offset);
+      }
+    }
+    if (!last) {
+      const merged_point & v = job.voxels[i];
+      for (int j=0; j<3; j++) sum[j] += v.sum[j];
+      count += v.count;
+    }
+    prev = val;
+  }
+  return NULL;
+}
+
+/** Description of the octree that is computed from the points before storing them. */
+struct octree_layout {
+  int layers;
+  int bottom_layer;
+  int repeat_mask;
+  int repeat_depth;
+  uint64_t nodesum;
+  uint64_t nodecount[D];
+  uint32_t bounds_min[3];
+  uint32_t bounds_max[3];
+};
+
+/** Stores the merged points in an octree file with nodes of type N and optionally writes its compact, packed and split versions. 
+ * The nodes are built by a thread for each of the parts in which the points were merged.
+ * The average colors are computed by the given mixer.
+ * If merge is set, identical subtrees are stored only once. 
+ * Unless order is OCTREE_ORDER_LAYERS, the nodes are reordered afterwards.
+ * Returns false if one of the other versions could not be written.
+ */
+template<typename N>
+bool store(Timer& t, const merged_point * voxels, uint64_t length, const std::vector<merged_part> & parts, const octree_layout& l, int threads, const color_mixer & mixer, bool merge, octree_order order, int split_bits, const char * outfile, const char * compactfile, const char * packedfile, const char * splitfile) {
+  // Prepare output file and map it to memory
+  uint64_t filesize = l.nodesum*sizeof(N);
+  printf("[%10.0f] Creating octree file with %lu nodes of %luB each (%luMiB).\n", t.elapsed(), l.nodesum, sizeof(N), filesize>>20);
+  octree_file out(outfile, filesize, sizeof(N)==sizeof(octree) ? OCTREE_NODES : OCTREE_WIDE);
+  N* root = (N*)out.root;
+  clear(root[0]);
+  
+  // Determine index offsets for each layer
+  uint64_t offset[D], bounds[D];
+  for (int j=0; j<D; j++) {offset[j]=0; bounds[j]=0;}
+  offset[l.layers] = 0;
+  for (int i=l.layers-1; i>=l.bottom_layer; i--) {
+    offset[i] = offset[i+1] + l.nodecount[i+1]; 
+    bounds[i] = offset[i] + l.nodecount[i];
+  }  
+  
+  // Describe the octree in the file header.
+  // Layer i consists of the nodes that span 8^i points, the root being the only node in the top layer.
+  octree_header& header = *out.header;
+  header.depth = l.layers;
+  header.bottom_layer = l.bottom_layer;
+  header.mix = mixer.flags();
+  for (int j=0; j<3; j++) {
+    header.bounds[j*2] = l.bounds_min[j];
+    header.bounds[j*2+1] = l.bounds_max[j] + 1;
+  }
+  for (int i=l.layers; i>l.bottom_layer; i--) {
+    header.layer_offset[i] = offset[i];
+    header.layer_count[i] = l.nodecount[i];
   }
+  
+  // Split the points in parts of whole cells of the split layer, which is the highest layer below the root that
+  // has enough cells to divide the work evenly. Each part is stored by a separate thread.
+  // The parts start at the first cell that starts in each of the parts in which the points were merged, 
+  // such that the nodes before a part are those counted while merging and those of the points that are skipped.
+  int split_layer = l.layers-1;
+  while (split_layer>l.bottom_layer && l.nodecount[split_layer] < 64*(uint64_t)threads) split_layer--;
+  split_layer = std::max(split_layer, l.bottom_layer);
+  std::vector<build_job<N> > jobs(parts.size());
+  uint64_t before[D]; // Number of nodes per layer that start before the current merged part.
+  std::fill(before, before+D, 0);
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    jobs[i].voxels = voxels;
+    jobs[i].root = root;
+    jobs[i].bottom_layer = l.bottom_layer;
+    jobs[i].split_layer = split_layer;
+    jobs[i].mixer = &mixer;
+    for (int j=l.bottom_layer+1; j<=split_layer; j++) jobs[i].offset[j] = offset[j] + before[j];
+    // Move the start of the part forward to the start of the next cell.
+    uint64_t begin = parts[i].begin;
+    while (begin > 0 && begin < length && (voxels[begin].key >> split_layer*3) == (voxels[begin-1].key >> split_layer*3)) {
+      for (int j=l.bottom_layer+1; j<=split_layer; j++) {
+        if ((voxels[begin].key >> j*3) != (voxels[begin-1].key >> j*3)) jobs[i].offset[j]++;
+      }
+      begin++;
+    }
+    jobs[i].begin = begin;
+    if (i > 0) jobs[i-1].end = begin;
+    for (int j=0; j<D; j++) before[j] += parts[i].nodecount[j];
+  }
+  jobs.back().end = length;
+  
+  // Read the points and store the nodes, keeping the nodes that contain the current point open.
+  // As the points are sorted, a node is complete once a point outside of it is read. It is then
+  // written at the next index of its layer and its average color is stored in its parent.
+  printf("[%10.0f] Storing points using %lu threads, split at layer %d.\n", t.elapsed(), jobs.size(), split_layer);
+  run_jobs(jobs, build_cells<N>);
+  for (int j=l.bottom_layer+1; j<=split_layer; j++) {
+    assert(jobs.back().offset[j]==bounds[j]);
+  }
+  
+  // Store the nodes above the split layer, which are shared by the parts.
+  printf("[%10.0f] Storing top layers.\n", t.elapsed());
+  open_nodes<N> open(split_layer+1, l.layers, mixer);
+  uint64_t prev = 0;
+  bool first = true;
+  for (unsigned int i=0; i<jobs.size(); i++) {
+    for (uint64_t k=0; k<jobs[i].cells.size(); k++) {
+      const split_cell & c = jobs[i].cells[k];
+      for (int j=split_layer+1; !first && j<l.layers && (c.val>>j*3) != (prev>>j*3); j++) {
+        open.close(root, j, prev, offset);
+      }
+      open.set(split_layer+1, c.val, c.child, c.color, c.count);
+      prev = c.val;
+      first = false;
+    }
+  }
+  for (int j=split_layer+1; j<l.layers; j++) {
+    open.close(root, j, prev, offset);
+  }
+  root[0] = open.node[l.layers];
+  uint32_t color = open.color(l.layers);
+  for (int j=split_layer+1; j<l.layers; j++) {
+    assert(offset[j]==bounds[j]);
+  }
+  
+  printf("[%10.0f] Replicating model.\n", t.elapsed());
+  replicate(root, 0, l.repeat_mask, l.repeat_depth);
+  
+  uint64_t nodes = l.nodesum;
+  if (merge) {
+    printf("[%10.0f] Merging identical subtrees.\n", t.elapsed());
+    nodes = merge_subtrees<N>(t, out, l.layers, l.bottom_layer);
+    printf("[%10.0f] Reduced octree to %lu nodes (%luMiB).\n", t.elapsed(), nodes, nodes*sizeof(N)>>20);
+  }
+  
+  if (order != OCTREE_ORDER_LAYERS) {
+    printf("[%10.0f] Reordering nodes.\n", t.elapsed());
+    std::vector<uint64_t> sequence;
+    order = order_nodes(root, nodes, order, sequence);
+    std::vector<N> copy(root, root+nodes);
+    reorder_nodes(&copy[0], nodes, sequence, root);
+    nodes = sequence.size();
+    out.shrink(nodes*sizeof(N));
+    header.order = order;
+    memset(header.layer_offset, 0, sizeof(header.layer_offset));
+  }
+  
+  bool complete = true;
+  if (compactfile) {
+    printf("[%10.0f] Writing compact octree to '%s'.\n", t.elapsed(), compactfile);
+    complete = write_compact(root, nodes, color, header, compactfile);
+  }
+  
+  if (packedfile) {
+    printf("[%10.0f] Writing packed octree to '%s'.\n", t.elapsed(), packedfile);
+    write_packed(root, nodes, header, packedfile);
+  }
+  
+  if (splitfile) {
+    printf("[%10.0f] Writing split octree with %d-bit colors to '%s'.\n", t.elapsed(), split_bits, splitfile);
+    write_split(root, nodes, split_bits, header, splitfile);
+  }
+  return complete;
 }
 
 int main(int argc, char ** argv){
   Timer t;
+  bool compact = false;
+  bool wide = false;
+  bool packed = false;
+  bool merge = false;
+  bool weighted = false;
+  bool gamma = false;
+  octree_order order = OCTREE_ORDER_LAYERS;
+  int split_bits = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  // By default, half of the physical memory is used for sorting.
+  uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "cwzdagr:s:t:m:")) != -1) {
+    switch (opt) {
+      case 'c':
+        compact = true;
+        break;
+      case 'w':
+        wide = true;
+        break;
+      case 'z':
+        packed = true;
+        break;
+      case 'd':
+        merge = true;
+        break;
+      case 'a':
+        weighted = true;
+        break;
+      case 'g':
+        gamma = true;
+        break;
+      case 'r':
+        order = parse_order(optarg);
+        break;
+      case 's':
+        split_bits = atoi(optarg);
+        if (split_bits != 16 && split_bits != 32) {
+          fprintf(stderr, "Colors of split files must have 16 or 32 bits.\n");
+          exit(2);
+        }
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        break;
+      case 'm':
+        memory = strtoull(optarg, NULL, 10) << 20;
+        if (memory == 0) {
+          fprintf(stderr, "The amount of memory for sorting must be given in MiB.\n");
+          exit(2);
+        }
+        break;
+      default:
+        exit(2);
+    }
+  }
+  if (wide && packed) {
+    fprintf(stderr, "Packed files with 64-bit child indices are not supported.\n");
+    exit(2);
+  }
+  if (wide && split_bits) {
+    fprintf(stderr, "Split files with 64-bit child indices are not supported.\n");
+    exit(2);
+  }
+  argc -= optind-1;
+  argv += optind-1;
   if (argc != 2 && argc != 4) {
     fprintf(stderr,"Please specify the file to convert (without '.vxl') and optionally repeat mask & depth.\n");
     exit(2);
@@ -179,69 +1070,65 @@ int main(int argc, char ** argv){
   int length=strlen(name);
   char infile[length+9];
   char outfile[length+9];
+  char compactfile[length+9];
+  char packedfile[length+9];
+  char splitfile[length+9];
+  char runfile[length+9];
+  char mergefile[length+9];
   sprintf(infile, "vxl/%s.vxl", name);
   sprintf(outfile, "vxl/%s.oct", name);
+  sprintf(compactfile, "vxl/%s.svo", name);
+  sprintf(packedfile, "vxl/%s.ocz", name);
+  sprintf(splitfile, "vxl/%s.ocs", name);
+  sprintf(runfile, "vxl/%s.run", name);
+  sprintf(mergefile, "vxl/%s.mrg", name);
   
   // Map input file to memory
   printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), infile);
   pointset in(infile, true);
 
-  // Check and possibly sort the data points.
-  printf("[%10.0f] Checking if %d points are sorted.\n", t.elapsed(), in.length);
-  int64_t old = 0;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Checking ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
-    }
-    int64_t cur = hilbert3d(in.list[i]);
-    if (old>cur) {
-      printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), i);
-      if (in.write) {
-        printf("[%10.0f] Sorting points.\n", t.elapsed());
-        in.enable_write(true);
-        // TODO: replace with IO-efficient k-way quicksort, with inline hilbert curve computation.
-        // TODO: branch into multiple threads at some point if meaningful.
-        std::sort(in.list, in.list+in.length, hilbert3d_compare);
-        in.enable_write(false);
-      } else {
-        printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), infile);
-        exit(1);
-      }
-      break;
+  // Check and possibly sort the data points, while merging the points at equal positions.
+  // The merged points are stored in a temporary file, as they may not fit in memory.
+  color_mixer mixer(weighted, gamma);
+  merged_point * voxels = (merged_point*)map_temporary(mergefile, std::max<uint64_t>(in.length, 1) * sizeof(merged_point));
+  uint64_t merged = 0;
+  uint32_t bounds_min[3], bounds_max[3];
+  std::vector<merged_part> parts;
+  if (!merge_all(t, in, threads, mixer, voxels, merged, bounds_min, bounds_max, parts)) {
+    if (!in.write) {
+      printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), infile);
+      exit(1);
     }
-    old = cur;
+    printf("[%10.0f] Sorting points.\n", t.elapsed());
+    sort_points(t, in, threads, memory, runfile);
+    bool sorted = merge_all(t, in, threads, mixer, voxels, merged, bounds_min, bounds_max, parts);
+    assert(sorted);
+    (void)sorted;
   }
+  // The points are not read again.
+  madvise(in.list, in.size, MADV_DONTNEED);
   
-  // Count nodes per layer
+  // Sum the nodes per layer that were counted while merging.
   // Used to determine file structure and size.
   // Layers are counted as well.
-  printf("[%10.0f] Counting nodes per layer.\n", t.elapsed());
   uint64_t nodecount[D];
   int64_t maxnode=0;
   for (int j=0; j<D; j++) nodecount[j]=0;
-  old = -1;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Counting ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
-    }
-    point q = in.list[i];
-    assert(q.c<0x1000000);    
-    int64_t cur = morton3d(q.x, q.y, q.z);
-    for (int j=0; j<D; j++) {
-      if ((cur>>j*3)!=(old>>j*3)) {
-        nodecount[j]++;
-      }
-    }
-    old = cur;
-    if (maxnode<cur)
-      maxnode=cur;
+  for (unsigned int i=0; i<parts.size(); i++) {
+    for (int j=0; j<D; j++) nodecount[j] += parts[i].nodecount[j];
+    maxnode = std::max(maxnode, parts[i].maxnode);
   }
   printf("[%10.0f] Counting layers (maxnode=0x%lx).\n", t.elapsed(), maxnode);
   int layers=0;
   while(maxnode>>layers*3) layers++;
   printf("[%10.0f] Found 1 leaf layer + %d data layers + %d repetition layers.\n", t.elapsed(), layers, repeat_depth);
   assert(nodecount[layers]==1);
+  // Copies of the model are placed next to each other in the directions that are not masked.
+  for (int j=0; j<3; j++) {
+    if (!(repeat_mask & 4>>j)) bounds_max[j] += ((1<<repeat_depth)-1)<<layers;
+  }
   layers+=repeat_depth;
+  assert(layers<OCTREE_LAYERS);
   
   // Determine lower layer prunning
   printf("[%10.0f] Determine lower layer pruning.\n", t.elapsed());
@@ -261,58 +1148,30 @@ int main(int argc, char ** argv){
       printf("[%10.0f] At layer %2d: %8lu pruned nodes.\n", t.elapsed(), i, nodecount[i]);
     }
   }
-  uint64_t filesize = nodesum*sizeof(octree);
-  
-  // Prepare output file and map it to memory
-  printf("[%10.0f] Creating octree file with %lu nodes of %luB each (%luMiB).\n", t.elapsed(), nodesum, sizeof(octree), filesize>>20);
-  octree_file out(outfile, filesize);
-  octree* root = out.root;
-  clear(root[0]);
-  
-  // Determine index offsets for each layer
-  uint32_t offset[D], bounds[D];
-  for (int j=0; j<D; j++) {offset[j]=0; bounds[j]=0;}
-  offset[layers] = 0;
-  for (int i=layers-1; i>=bottom_layer; i--) {
-    offset[i] = offset[i+1] + nodecount[i+1]; 
-    bounds[i] = offset[i] + nodecount[i];
-  }  
-  
-  // Read voxels and store them.
-  printf("[%10.0f] Storing points.\n", t.elapsed());
-  uint32_t i;
-  uint32_t nodes_created = 0;
-  for (i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) printf("[%10.0f] Stored %6.2f%% points (%luMiB).\n", t.elapsed(), i*100.0/in.length, nodes_created*sizeof(octree)>>20);
-    point p(in.list[i]);
-    uint64_t val = morton3d(p.z, p.y, p.x);
-    octree * cur = &root[0];
-    //fprintf(stderr,"val=%15lx, p{x=%d,y=%d,x=%d,c=%6x.\n", val, p.x, p.y, p.z, p.c);
-    for (int depth = layers-1; depth >= bottom_layer; depth--) {
-      int idx = (val >> depth*3)&7;
-      //fprintf(stderr,"i=%u, depth=%d, idx=%d, offset[depth]=%u, cur=%ld.\n", i, depth, idx, offset[depth], cur-root);
-      if (depth<=bottom_layer) {
-        cur->avgcolor[idx] = p.c;
-      } else {
-        if (~cur->child[idx]==0u) {
-          assert(nodes_created<nodesum);
-          assert(offset[depth]<bounds[depth]);
-          nodes_created++;
-          uint32_t next = offset[depth]++;
-          //fprintf(stderr,"Created node %d (%d)\n", next, nodes_created);
-          clear(root[next]);
-          cur->child[idx] = next;
-        }
-        assert(cur->child[idx]<nodesum);
-        cur = &root[cur->child[idx]];
-      }
+  if (nodesum >= 0xffffffffu) {
+    if (packed) {
+      fprintf(stderr, "The octree needs 64-bit child indices, which packed files do not support.\n");
+      exit(1);
+    }
+    if (split_bits) {
+      fprintf(stderr, "The octree needs 64-bit child indices, which split files do not support.\n");
+      exit(1);
     }
+    wide = true;
   }
-  printf("[%10.0f] Computing average colors.\n", t.elapsed());
-  average(root, 0);
   
-  printf("[%10.0f] Replicating model.\n", t.elapsed());
-  replicate(root, 0, repeat_mask, repeat_depth);
+  octree_layout layout = {layers, bottom_layer, repeat_mask, repeat_depth, nodesum, {}, {}, {}};
+  memcpy(layout.nodecount, nodecount, sizeof(nodecount));
+  memcpy(layout.bounds_min, bounds_min, sizeof(bounds_min));
+  memcpy(layout.bounds_max, bounds_max, sizeof(bounds_max));
+  bool written;
+  if (wide) {
+    written = store<wide_octree>(t, voxels, merged, parts, layout, threads, mixer, merge, order, split_bits, outfile, compact ? compactfile : NULL, packed ? packedfile : NULL, split_bits ? splitfile : NULL);
+  } else {
+    written = store<octree>(t, voxels, merged, parts, layout, threads, mixer, merge, order, split_bits, outfile, compact ? compactfile : NULL, packed ? packedfile : NULL, split_bits ? splitfile : NULL);
+  }
+  
+  if (!written) exit(1);
   
   // Done with conversion, clean up.
   printf("[%10.0f] Done.\n", t.elapsed());
@@ -0,0 +1,42 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <algorithm>
+#include "color_mixer.h"
+#include "octree.h"
+
+/** Creates the tables that convert sRGB channels to 16-bit linear intensities and back. 
+ * If gamma is not set, the tables leave the channels unchanged.
+ */
+color_mixer::color_mixer(bool weighted, bool gamma) : weighted(weighted), gamma(gamma) {
+    for (int i=0; i<256; i++) {
+        double v = i/255.0;
+        linear[i] = gamma ? 65535 * (v <= 0.04045 ? v/12.92 : pow((v+0.055)/1.055, 2.4)) + 0.5 : i;
+    }
+    for (int i=0; i<65536; i++) {
+        double v = i/65535.0;
+        srgb[i] = gamma ? 255 * (v <= 0.0031308 ? v*12.92 : 1.055*pow(v, 1/2.4)-0.055) + 0.5 : std::min(i, 255);
+    }
+}
+
+uint32_t color_mixer::flags() const {
+    return (weighted ? OCTREE_MIX_WEIGHTED : 0) | (gamma ? OCTREE_MIX_GAMMA : 0);
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
@@ -0,0 +1,78 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COLOR_MIXER_H
+#define COLOR_MIXER_H
+#include <stdint.h>
+
+/** Averages colors with integer arithmetic.
+ * If weighted is set, the colors of the children of a node are weighted by the number of points they contain, 
+ * otherwise each child counts once. If gamma is set, the sRGB colors are averaged as 16-bit linear intensities, 
+ * such that the colors of the upper layers have the brightness of the voxels below them.
+ * The mode is recorded in the mix field of the octree header, such that edits average the colors in the same way.
+ */
+struct color_mixer {
+    bool weighted;
+    bool gamma;
+    /** Converts a channel to the intensity that is averaged, which is the channel itself if gamma is not set. */
+    uint32_t linear[256];
+    /** Converts an averaged intensity back to a channel. */
+    uint8_t srgb[65536];
+    color_mixer(bool weighted, bool gamma);
+    /** Returns the mode of the mixer as a bitwise or of octree_mix flags. */
+    uint32_t flags() const;
+    /** Adds the channels of the color, multiplied by the weight, to the sums. */
+    void add(uint64_t sum[3], uint32_t color, uint64_t weight) const {
+        for (int j=0; j<3; j++) {
+            sum[j] += weight * linear[color >> (2-j)*8 & 0xff];
+        }
+    }
+    /** Returns the color of the sums divided by the total weight, rounded to the nearest value. */
+    uint32_t mix(const uint64_t sum[3], uint64_t weight) const {
+        uint32_t color = 0;
+        for (int j=0; j<3; j++) {
+            color = color<<8 | srgb[(sum[j] + weight/2) / weight];
+        }
+        return color;
+    }
+    /** Returns the average color of the children of a node that are present, given the number of points in each child,
+     * which is only read if the mixer is weighted. At least one child must be present.
+     * Absent children have weight 0 and both modes use the tables, such that the loops have no branches.
+     */
+    template<typename N>
+    uint32_t average(const N& n, const uint64_t * points) const {
+        static const uint64_t once[8] = {1, 1, 1, 1, 1, 1, 1, 1};
+        const uint64_t * count = weighted ? points : once;
+        uint64_t weight[8], total = 0;
+        for (int i=0; i<8; i++) {
+            weight[i] = -(uint64_t)(n.avgcolor[i]>=0) & count[i];
+            total += weight[i];
+        }
+        uint64_t r = 0, g = 0, b = 0;
+        for (int i=0; i<8; i++) {
+            uint32_t color = n.avgcolor[i];
+            r += weight[i] * linear[color >> 16 & 0xff];
+            g += weight[i] * linear[color >> 8 & 0xff];
+            b += weight[i] * linear[color & 0xff];
+        }
+        const uint64_t sum[3] = {r, g, b};
+        return mix(sum, total);
+    }
+};
+
+#endif
@@ -0,0 +1,102 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "timing.h"
+#include "octree.h"
+#include "octree_edit.h"
+
+/* Applies a sequence of edits to the voxels of an octree file.
+ * The result replaces the original file.
+ */
+
+static void usage() {
+  fprintf(stderr,"Please specify the file to edit (without 'vxl/' & '.oct'), followed by one or more edits:\n");
+  fprintf(stderr,"  insert x1 x2 y1 y2 z1 z2 color\n");
+  fprintf(stderr,"  remove x1 x2 y1 y2 z1 z2\n");
+  fprintf(stderr,"  recolor x1 x2 y1 y2 z1 z2 color\n");
+  fprintf(stderr,"The boxes are given in point coordinates, with x2, y2 and z2 exclusive, and colors as hexadecimal RGB.\n");
+  exit(2);
+}
+
+static uint32_t parse(const char * text, int base) {
+  char * end;
+  unsigned long v = strtoul(text, &end, base);
+  if (*end || end == text) {
+    fprintf(stderr,"Could not parse '%s'.\n", text);
+    exit(2);
+  }
+  return v;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 3) usage();
+  Timer t;
+
+  // Determine the file names.
+  char * name = argv[1];
+  int length=strlen(name);
+  char infile[length+9];
+  sprintf(infile, "vxl/%s.oct", name);
+
+  printf("[%10.0f] Opening '%s'.\n", t.elapsed(), infile);
+  octree_file in(infile);
+  if (!in.verify()) {
+    fprintf(stderr, "The checksum in the header does not match the nodes, '%s' is damaged and left unchanged.\n", infile);
+    exit(1);
+  }
+  octree_editor editor(&in);
+  uint64_t nodes = in.nodes();
+
+  for (int i=2; i<argc; ) {
+    const char * op = argv[i++];
+    bool colored = strcmp(op, "insert") == 0 || strcmp(op, "recolor") == 0;
+    if (!colored && strcmp(op, "remove") != 0) usage();
+    if (i + 6 + colored > argc) usage();
+    uint32_t box[6];
+    for (int j=0; j<6; j++) box[j] = parse(argv[i++], 10);
+    for (int j=0; j<3; j++) {
+      if (box[j*2] >= box[j*2+1]) {
+        fprintf(stderr,"The box of '%s' is empty, as %c2 must be larger than %c1.\n", op, 'x'+j, 'x'+j);
+        exit(2);
+      }
+    }
+    uint32_t color = colored ? parse(argv[i++], 16) : 0;
+    bool done;
+    if (op[0] == 'i') {
+      done = editor.insert(box, color);
+    } else if (op[0] == 'r' && op[2] == 'm') {
+      done = editor.remove(box);
+    } else {
+      done = editor.recolor(box, color);
+    }
+    if (!done) {
+      fprintf(stderr,"The edits need more nodes than 32-bit child indices can address, '%s' is left unchanged.\n", infile);
+      exit(1);
+    }
+  }
+  printf("[%10.0f] Edited the octree, appending %lu nodes.\n", t.elapsed(), in.nodes() - nodes);
+
+  editor.save(infile);
+  printf("[%10.0f] Done.\n", t.elapsed());
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
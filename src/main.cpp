@@ -22,38 +22,81 @@
 #include <cassert>
 #include <algorithm>
 #include <cstring>
+#include <unistd.h>
 
 #include "timing.h"
 #include "events.h"
 #include "art.h"
 #include "octree.h"
+#include "scene.h"
+#include "render_options.h"
 
 using namespace std;
 
 
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    render_options options;
+    int first = render_parse_options(argc, argv, options);
+    if (first+1 != argc) {
         fprintf(stderr,"Please specify the file to load (without 'vxl/' & '.oct').\n");
         exit(2);
     }
+    char * name = argv[first];
+    scene * world = render_load(name, options);
 
-    // Determine the file names.
-    char * name = argv[1];
-    int length=strlen(name);
-    char infile[length+9];
-    sprintf(infile, "vxl/%s.oct", name);
-    octree_file in(infile);
-
-    init_screen("Voxel renderer");
     position = glm::dvec3(0, 0, 0);
+    bool bounded = false;
+    glm::dvec3 lo, hi;
+    for (unsigned int i=0; i<world->instances.size(); i++) {
+        const scene_instance & instance = world->instances[i];
+        const octree_header * header = instance.file->header;
+        if (!header) continue;
+        if (header->depth > SCENE_DEPTH + 1) {
+            fprintf(stderr, "Warning: only the top %d of the %u layers of the octree are rendered.\n", SCENE_DEPTH + 1, header->depth);
+        }
+        double scale = ldexp(1, SCENE_DEPTH + 1 - header->depth);
+        glm::dvec3 a, b;
+        for (int j=0; j<3; j++) {
+            a[j] = header->bounds[j*2] * scale - (1<<SCENE_DEPTH);
+            b[j] = header->bounds[j*2+1] * scale - (1<<SCENE_DEPTH);
+        }
+        a = instance.orientation * a + instance.offset;
+        b = instance.orientation * b + instance.offset;
+        if (!bounded) {
+            lo = hi = a;
+            bounded = true;
+        }
+        lo = glm::min(lo, glm::min(a, b));
+        hi = glm::max(hi, glm::max(a, b));
+    }
+    if (bounded) {
+        // Start in front of the models, looking at them along the z-axis.
+        glm::dvec3 extent = hi - lo;
+        position = (lo + hi) * 0.5;
+        position.z = lo.z - max(extent.x, extent.y);
+    }
+    
+    if (options.headless) {
+        // Render a single frame without opening a window.
+        init_headless();
+        clear_creen();
+        octree_draw(*world);
+        if (options.image) save_screen(options.image);
+        return 0;
+    }
+    
+    init_screen("Voxel renderer");
     
     // mainloop
+    uint64_t pages = 0;
     while (!quit) {
         Timer t;
-        if (moves) {
+        // Also redraw when the pager has loaded nodes that were missing.
+        if (moves || pages != render_pages_loaded()) {
+            pages = render_pages_loaded();
             clear_creen();
-            octree_draw(&in);
+            octree_draw(*world);
             //draw_box();
             flip_screen();
             
@@ -71,6 +114,7 @@ int main(int argc, char *argv[]) {
         handle_events();
     }
     
+    if (options.image) save_screen(options.image);
     return 0;
 }
 
@@ -0,0 +1,217 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "octree.h"
+
+/* Reports statistics of the nodes of an octree file, layer by layer, starting at the root.
+ * These show how much of the file is spent on empty child slots, how many subtrees are shared
+ * and how many cache lines are read per traversal step, which depend on the layout of the nodes.
+ */
+
+namespace {
+  const uint64_t NONE = ~0ull;
+  const uint32_t CACHE_LINE = 64;
+
+  /** Reads the children of a node in the formats that store a child index and a color for every child. */
+  template<typename N>
+  struct full_view {
+    const N * nodes;
+    full_view(const octree_file & f) : nodes((const N*)f.root) {}
+    bool present(uint64_t node, int i) const {return nodes[node].avgcolor[i] >= 0;}
+    uint64_t child(uint64_t node, int i) const {return ~nodes[node].child[i] ? nodes[node].child[i] : NONE;}
+    /** Bytes spent on the child index and color of an empty child, and the child index of a leaf. */
+    static uint32_t empty_bytes() {return sizeof(N().child[0]) + sizeof(int32_t);}
+    static uint32_t leaf_bytes() {return sizeof(N().child[0]);}
+    /** Size of the part of a node that is read to find its children. */
+    static uint32_t stride() {return sizeof(N);}
+  };
+
+  /** Reads the children of a node in the split formats, whose colors are stored apart from the nodes. */
+  template<typename color_t>
+  struct split_view {
+    const split_octree * nodes;
+    split_view(const octree_file & f) : nodes(f.split_root) {}
+    bool present(uint64_t node, int i) const {return nodes[node].child[i] != SPLIT_EMPTY;}
+    uint64_t child(uint64_t node, int i) const {return nodes[node].child[i] < SPLIT_EMPTY ? nodes[node].child[i] : NONE;}
+    static uint32_t empty_bytes() {return sizeof(uint32_t) + sizeof(color_t);}
+    static uint32_t leaf_bytes() {return sizeof(uint32_t);}
+    static uint32_t stride() {return sizeof(split_octree);}
+  };
+
+  const char * format_name(octree_format format) {
+    switch (format) {
+      case OCTREE_NODES: return "nodes";
+      case OCTREE_COMPACT: return "compact";
+      case OCTREE_WIDE: return "wide";
+      case OCTREE_PACKED: return "packed";
+      case OCTREE_SPLIT: return "split";
+      case OCTREE_SPLIT16: return "split16";
+    }
+    return "unknown";
+  }
+
+  const char * order_name(uint32_t order) {
+    switch (order) {
+      case OCTREE_ORDER_LAYERS: return "layers";
+      case OCTREE_ORDER_DEPTH_FIRST: return "depth first";
+      case OCTREE_ORDER_VEB: return "van Emde Boas";
+    }
+    return "unknown";
+  }
+
+  /** Visits the nodes layer by layer and prints the statistics of each layer.
+   * Every node is visited once, in the first layer in which it is reachable. Later references to it, 
+   * from the same or a deeper layer, are counted as shared instead, which also ends the walk on cyclic models.
+   */
+  template<typename V>
+  void analyze(const octree_file & f, const V & v) {
+    const uint64_t nodes = f.nodes();
+    const uint32_t size = octree_file::node_size(f.format);
+    const uint32_t stride = v.stride();
+    // Offset of the nodes relative to the start of the mapping, which is aligned to pages.
+    const uint64_t offset = f.header ? sizeof(octree_header) : 0;
+    const uint64_t pagesize = getpagesize();
+
+    printf("%5s %11s %7s  %-53s%7s%8s%12s%12s%12s\n", "layer", "nodes", "shared", "children per node (%)", "leaf%", "empty%", "wasted", "lines/step", "same page%");
+    printf("%26s", "");
+    for (int i=0; i<=8; i++) printf(" %5d", i);
+    printf("\n");
+    std::vector<uint64_t> level(1, 0), next;
+    std::vector<bool> visited(nodes);
+    visited[0] = true;
+    uint64_t reachable = 0, wasted = 0, shared = 0, references = 0;
+    for (int depth = 0; !level.empty(); depth++) {
+      uint64_t histogram[9] = {};
+      uint64_t next_shared = 0;
+      uint64_t leaves = 0, empty = 0, lines = 0, steps = 0, same_page = 0;
+      for (uint64_t j=0; j<level.size(); j++) {
+        uint64_t node = level[j];
+        uint64_t start = offset + node * stride;
+        uint64_t line[24];
+        int line_count = 0, count = 0;
+        for (int i=0; i<8; i++) {
+          if (!v.present(node, i)) {
+            empty++;
+            continue;
+          }
+          count++;
+          uint64_t c = v.child(node, i);
+          if (c == NONE) {
+            leaves++;
+            continue;
+          }
+          if (c >= nodes) {
+            fprintf(stderr, "Node %lu refers to node %lu, which does not exist.\n", node, c);
+            exit(1);
+          }
+          if (visited[c]) {
+            next_shared++;
+          } else {
+            visited[c] = true;
+            next.push_back(c);
+          }
+          // Count the distinct cache lines that hold the children, as these are read when visiting them.
+          uint64_t child_start = offset + c * stride;
+          for (uint64_t l = child_start / CACHE_LINE; l <= (child_start + stride - 1) / CACHE_LINE; l++) {
+            if (std::find(line, line + line_count, l) == line + line_count) line[line_count++] = l;
+          }
+          steps++;
+          if (child_start / pagesize == start / pagesize) same_page++;
+        }
+        histogram[count]++;
+        lines += line_count;
+      }
+      uint64_t n = level.size();
+      uint64_t slots = n * 8;
+      uint64_t waste = empty * v.empty_bytes() + leaves * v.leaf_bytes();
+      printf("%5d %11lu %7lu ", depth, n, shared);
+      for (int i=0; i<=8; i++) printf(" %5.1f", histogram[i] * 100.0 / n);
+      printf("  %5.1f  %6.1f %11lu  %10.2f  %10.1f\n",
+        leaves * 100.0 / slots, empty * 100.0 / slots, waste,
+        steps ? (double)lines / steps : 0.0, steps ? same_page * 100.0 / steps : 0.0);
+      reachable += n;
+      wasted += waste;
+      shared = next_shared;
+      references += next_shared;
+      level.swap(next);
+      next.clear();
+    }
+    printf("\nReachable nodes: %lu of %lu, shared references: %lu, wasted bytes: %lu of %lu (%.1f%%).\n",
+      reachable, nodes, references, wasted, nodes * size, wasted * 100.0 / (nodes * size));
+  }
+}
+
+int main(int argc, char ** argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr,"Please specify the file to analyze (without 'vxl/' & '.oct') and optionally its extension (oct or ocs).\n");
+    exit(2);
+  }
+
+  // Determine the file names.
+  char * name = argv[1];
+  const char * extension = argc == 3 ? argv[2] : "oct";
+  int length=strlen(name);
+  char infile[length+strlen(extension)+6];
+  sprintf(infile, "vxl/%s.%s", name, extension);
+  octree_file in(infile);
+  bool damaged = false;
+
+  printf("File:   %s\n", infile);
+  printf("Format: %s, %u bytes per node, %lu nodes, %lu bytes\n", format_name(in.format), octree_file::node_size(in.format), in.nodes(), in.size);
+  if (in.header) {
+    printf("Depth:  %u layers", in.header->depth);
+    if (in.header->bottom_layer) printf(", of which the lowest %u are pruned", in.header->bottom_layer);
+    printf("\n");
+    printf("Order:  %s\n", order_name(in.header->order));
+    if (!in.verify()) {
+      fprintf(stderr, "The checksum in the header does not match the nodes, '%s' is damaged.\n", infile);
+      damaged = true;
+    }
+  } else {
+    printf("The file has no header, it was written by an older version of build_db.\n");
+  }
+  printf("\n");
+
+  switch (in.format) {
+    case OCTREE_NODES:
+      analyze(in, full_view<octree>(in));
+      break;
+    case OCTREE_WIDE:
+      analyze(in, full_view<wide_octree>(in));
+      break;
+    case OCTREE_SPLIT:
+      analyze(in, split_view<uint32_t>(in));
+      break;
+    case OCTREE_SPLIT16:
+      analyze(in, split_view<uint16_t>(in));
+      break;
+    default:
+      fprintf(stderr, "Files in the %s format cannot be analyzed.\n", format_name(in.format));
+      exit(1);
+  }
+  return damaged ? 1 : 0;
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
@@ -36,21 +36,187 @@ struct octree {
     int32_t avgcolor[8];
 };
 
+/** A node in an octree with more than 2^32 nodes. 
+ * Equal to octree, except that the child indices are 64 bit, with ~0 for leaves.
+ */
+struct wide_octree {
+    uint64_t child[8];
+    int32_t avgcolor[8];
+};
+
+/** The structure of a node in the split octree format, which stores the colors in a separate array.
+ * Children that are not present have index SPLIT_EMPTY, leaves have index ~0u as in octree.
+ * The nodes are followed by the 8 child colors of every node, such that the traversal
+ * only reads the colors of the nodes that are drawn.
+ */
+struct split_octree {
+    uint32_t child[8];
+};
+
+static const uint32_t SPLIT_EMPTY = ~1u;
+
+/** The largest child index of a node with 32-bit child indices,
+ * as ~0u marks leaves and SPLIT_EMPTY marks absent children in split_octree.
+ */
+static const uint32_t OCTREE_MAX_INDEX = ~2u;
+
+/** A node in the compact octree format, which uses 8 bytes per node.
+ *
+ * The children of a node are stored consecutively, ordered by index, 
+ * where absent children are left out. The lower 24 bits of data hold 
+ * the color of the node and the upper 8 bits the mask of children that 
+ * are present. The index of the first child is given by child.
+ * 
+ * A node without children is a leaf and completely filled with its color.
+ * The root of the octree is the node at index 0.
+ */
+struct compact_octree {
+    uint32_t child;
+    uint32_t data;
+};
+
+/** Half the size of the octree in world space, as a power of two. 
+ * Camera positions are given in this scale, independent of the depth of the octree.
+ */
+static const int32_t SCENE_DEPTH = 26;
+
+static const uint32_t OCTREE_MAGIC = 0x434f5856; // "VXOC"
+static const uint32_t OCTREE_VERSION = 2;
+static const int OCTREE_LAYERS = 32;
+
+/** Formats of the nodes in an octree file. */
+enum octree_format {
+    OCTREE_NODES   = 0, ///< octree nodes.
+    OCTREE_COMPACT = 1, ///< compact_octree nodes.
+    OCTREE_WIDE    = 2, ///< wide_octree nodes.
+    OCTREE_PACKED  = 3, ///< Blocks of octree nodes that are compressed independently, see octree_pack.h.
+    OCTREE_SPLIT   = 4, ///< split_octree nodes, followed by their colors as 24-bit RGB in 32 bits.
+    OCTREE_SPLIT16 = 5, ///< split_octree nodes, followed by their colors as 16-bit RGB565.
+};
+
+/** Orders of the nodes in an octree file. */
+enum octree_order {
+    OCTREE_ORDER_LAYERS      = 0, ///< Layer by layer, starting at the root, as described by the layer tables of the header.
+    OCTREE_ORDER_DEPTH_FIRST = 1, ///< Depth first, with every node directly followed by the subtree of its first child.
+    OCTREE_ORDER_VEB         = 2, ///< Van Emde Boas layout, which recursively stores the top half of the layers before each of the subtrees below it.
+};
+
+/** Flags that describe how the average colors of the nodes were computed, see color_mixer. */
+enum octree_mix {
+    OCTREE_MIX_WEIGHTED = 1, ///< Children are weighted by the number of points they contain, instead of counting once.
+    OCTREE_MIX_GAMMA    = 2, ///< Colors are averaged in linear light instead of in sRGB.
+};
+
+/** Header at the start of an octree file. 
+ * Files without a header, as written by older versions of build_db, can still be loaded.
+ * The size of the header is a multiple of the size of every node format, such that the nodes remain aligned.
+ */
+struct octree_header {
+    uint32_t magic;         ///< Equal to OCTREE_MAGIC.
+    uint32_t version;       ///< Equal to OCTREE_VERSION.
+    uint32_t format;        ///< One of octree_format.
+    uint32_t depth;         ///< Number of layers below the root, such that the octree spans 2^depth points in each direction.
+    uint32_t bottom_layer;  ///< Number of layers that were pruned, whose points are stored as the colors of their parents.
+    uint32_t checksum;      ///< FNV-1a hash of the nodes, computed over 32-bit words.
+    uint64_t nodes;         ///< Number of nodes following the header.
+    uint32_t bounds[6];     ///< Bounding box of the points: x1, x2, y1, y2, z1, z2, with x2, y2 and z2 exclusive.
+    uint64_t layer_offset[OCTREE_LAYERS]; ///< Index of the first node of each layer, with layer 0 being the points. Only valid if order is OCTREE_ORDER_LAYERS.
+    uint64_t layer_count[OCTREE_LAYERS];  ///< Number of nodes in each layer.
+    uint32_t block_nodes;   ///< Number of nodes per block in packed files.
+    uint16_t order;         ///< One of octree_order.
+    uint16_t mix;           ///< Bitwise or of octree_mix flags. Files written before the flags were recorded have 0.
+};
+
+/** An octree file, which is either in the original format (.oct) or in the compact format (.svo). 
+ * The size is the size of the nodes in bytes, excluding the header.
+ */
 struct octree_file {
     const bool write;
-    uint32_t size;
+    octree_format format;
+    uint64_t size;
     int32_t fd;
-    octree * root;
+    octree_header * header; ///< NULL for files without header.
+    uint32_t id;            ///< Unique for every opened file, used to invalidate caches.
+    uint32_t revision;      ///< Incremented by every edit of the nodes, used to invalidate renderings.
+    bool edited;            ///< Set while the nodes are replaced by those of an octree_editor.
+    union {
+        octree * root;
+        compact_octree * compact_root;
+        wide_octree * wide_root;
+        split_octree * split_root;
+        uint64_t * block_index; ///< Offsets of the compressed blocks in packed files, relative to the block index.
+    };
     octree_file(const char * filename);
-    octree_file(const char * filename, uint32_t size);
+    octree_file(const char * filename, uint64_t size, octree_format format);
+    static bool is_compact(const char * filename);
+    static uint32_t node_size(octree_format format);
+    uint64_t nodes() const {return header ? header->nodes : size / node_size(format);}
+    /** Returns the array of child colors of split files, which follows the nodes. */
+    void * split_colors() const {return split_root + nodes();}
+    uint32_t checksum() const;
+    bool verify() const;
+    void shrink(uint64_t size);
     ~octree_file();
 private:
+    char * base;
+    uint64_t length;
     octree_file(octree_file &);
     octree_file& operator=(octree_file&);
 };
 
+/** Options for mapping octree files for reading, a bitwise or of the values below. */
+extern int octree_map_options;
+enum {
+    OCTREE_WILLNEED  = 1, ///< Ask the kernel to start reading the whole file.
+    OCTREE_HUGEPAGES = 2, ///< Copy the file into memory backed by transparent huge pages.
+    OCTREE_PRETOUCH  = 4, ///< Touch every page after mapping, such that rendering does not page fault.
+};
+
 void octree_draw(octree_file* file);
 
+/** Number of threads used by octree_draw. 
+ * If larger than 1, the screen is split into tiles that are rendered concurrently.
+ * Every thread traverses the top layers of the octree itself, as they are shared by its tiles and those of the other threads.
+ */
+extern int render_threads;
+
+/** If set, octree_draw renders to the faces of a cubemap, which are reused while only the orientation changes.
+ */
+extern bool render_cubemap;
+
+/** If positive, octree_draw renders a coarse image first and refines it until this many milliseconds have passed.
+ * Not used if render_cubemap is set, which render_parse_options rejects.
+ */
+extern double render_budget;
+
+/** Size in pixels of the smallest octree nodes that are rendered. Values above 1 trade detail for speed.
+ */
+extern double render_lod;
+
+/** If set, the allowed node size is doubled every time the distance to the camera doubles beyond this distance,
+ * which is rounded to the nearest power of two.
+ */
+extern double render_lod_distance;
+
+/** If set, traverse() prefetches the nodes of the children that it is going to visit.
+ */
+extern bool render_prefetch;
+
+/** Size in MiB of the cache of decompressed blocks of packed octree files, for each render thread.
+ * The cache is shared by the packed files of a scene.
+ */
+extern int render_cache;
+
+void render_cache_stats(uint64_t & hits, uint64_t & misses);
+
+/** Memory budget in MiB for the nodes of octree files, which are then loaded by a background thread.
+ * The budget is split evenly between the paged files of a scene.
+ * Until the page of a node is loaded, its average color is drawn instead. If 0, nodes are read directly from the mapped file.
+ */
+extern int render_paging;
+
+uint64_t render_pages_loaded();
+
 uint32_t prepare_cubemap();
 
 #endif
@@ -17,7 +17,12 @@
 */
 
 #include <cstdio>
+#include <cmath>
 #include <algorithm>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 //#include <GL/gl.h>
 
 #include "art.h"
@@ -25,31 +30,81 @@
 #include "quadtree.h"
 #include "timing.h"
 #include "octree.h"
+#include "octree_pack.h"
+#include "octree_page.h"
+#include "scene.h"
 
 #define static_assert(test, message) typedef char static_assert__##message[(test)?1:-1]
 
 using std::max;
 using std::min;
 
+// Array with x1, x2, y1, y2. Note that x2-x1 = y2-y1.
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+// One value for each of the 8 children of an octree node.
+typedef int32_t v8si __attribute__ ((vector_size (32)));
+
 namespace {
-    quadtree face;
+    int32_t face_colors[quadtree::SIZE*quadtree::SIZE] __attribute__ ((aligned (64)));
+    quadtree main_face;
+    __thread quadtree * face;
     octree * root;
+    compact_octree * compact_root;
+    wide_octree * wide_root;
+    split_octree * split_root;
+    const void * split_colors;
+    const octree_file * packed_file;
+    
+    /** Cache of decompressed blocks of the packed files of the scene, one for each render thread. */
+    __thread block_cache * cache;
+    std::vector<block_cache*> caches;
+    uint32_t cache_blocks;
+    uint32_t cache_block_nodes = PACK_BLOCK_NODES;
+    
+    /** Loader of the pages of the current file, if render_paging is set. */
+    octree_pager * pager;
+    /** Loaders of the paged files of the current scene and the ids of their files. */
+    std::vector<octree_pager*> pagers;
+    std::vector<uint32_t> pager_files;
+    /** Memory budget of each pager, such that the pagers of the scene together stay within render_paging. */
+    uint64_t pager_budget;
+    
+    /** The scene that is drawn by render_view. */
+    const scene * current_scene;
     int C;
+    
+    /** Quadtree nodes with this index or higher are painted instead of subdivided. 
+     * Lowering it to the start of a higher level renders the screen in blocks of pixels.
+     */
+    int32_t quad_leaf = quadtree::M;
+    
+    /** Octree nodes are subdivided while the quadtree node is at most this large, relative to the octree node.
+     * The default of 2<<SCENE_DEPTH stops at octree nodes of about one pixel.
+     */
+    int32_t lod_limit;
+    /** log2 of render_lod_distance rounded to the nearest integer, or -1 if the error does not depend on the distance. */
+    int lod_shift;
+    
+    /** For each child, -1 if the child is offset by dx, dy or dz respectively from corner C, 0 otherwise. */
+    v8si child_dx, child_dy, child_dz;
 }
 
+bool render_prefetch = true;
+int render_cache = 64;
+int render_paging = 0;
+double render_lod = 1;
+double render_lod_distance = 0;
+
+int render_threads = 1;
+
 static_assert(quadtree::SIZE >= SCREEN_HEIGHT, quadtree_height_too_small);
 static_assert(quadtree::SIZE >= SCREEN_WIDTH,  quadtree_width_too_small);
 
-// Array with x1, x2, y1, y2. Note that x2-x1 = y2-y1.
-typedef int32_t v4si __attribute__ ((vector_size (16)));
-
 const v4si quad_permutation[8] = {
     {},{},{},{},
     {0,0,3,3},{1,1,3,3},{0,0,2,2},{1,1,2,2},
 };
 
-static const int32_t SCENE_DEPTH = 26;
-
 static const int DX=4, DY=2, DZ=1;
 static const v4si DELTA[8]={
     {-1,-1,-1},
@@ -64,14 +119,156 @@ static const v4si DELTA[8]={
 
 const v4si nil = {};
 
+/** Returns the detail limit for an octree node at the given position relative to the viewer.
+ * If render_lod_distance is set, the allowed error doubles every time the distance doubles beyond it.
+ */
+static inline int32_t detail_limit(const v4si pos) {
+    if (lod_shift < 0) return lod_limit;
+    v4si sign = pos>>31;
+    v4si dist = (pos^sign)-sign;
+    uint32_t d = max(dist[0], max(dist[1], dist[2])) >> lod_shift;
+    if (d <= 1) return lod_limit;
+    return lod_limit >> (31 - __builtin_clz(d));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/** Performs the frustum occlusion test of traverse() for all 8 children of an octree node at once.
+ * Returns a mask with bit i set if child i is not occluded.
+ */
+__attribute__((target("avx2")))
+static uint32_t child_mask_avx2(const v4si bound, const v4si dx, const v4si dy, const v4si dz) {
+    v8si visible = ~(v8si){};
+    for (int j=0; j<4; j++) {
+        int32_t x = dx[j], y = dy[j], z = dz[j];
+        // Bounds 0 and 2 must become negative, bounds 1 and 3 positive.
+        int32_t edge = j&1 ? max(x,0)+max(y,0)+max(z,0) : min(x,0)+min(y,0)+min(z,0);
+        v8si b = (bound[j]<<1) + edge + (child_dx & x) + (child_dy & y) + (child_dz & z);
+        visible &= j&1 ? b>0 : b<0;
+    }
+    return _mm256_movemask_ps((__m256)visible);
+}
+#else
+static uint32_t child_mask_avx2(const v4si, const v4si, const v4si, const v4si) {
+    return ~0u;
+}
+#endif
+
+/** Base of the node types that read the color of a child together with its structure. 
+ * The color_ref of a child is passed down by traverse() and resolved into a color when it is drawn.
+ */
+struct direct_color {
+    typedef uint32_t color_ref;
+    static uint32_t resolve(color_ref color) {return color;}
+};
+
+/** Accesses the children of a node in the original octree format. 
+ * Child indices of type index are passed to traverse(), where ~0 denotes a leaf.
+ */
+struct octree_node : direct_color {
+    typedef uint32_t index;
+    const octree & s;
+    octree_node(index octnode) : s(root[octnode]) {}
+    bool present(int i) const {return s.avgcolor[i]>=0;}
+    index child(int i) const {return s.child[i];}
+    uint32_t color(int i) const {return s.avgcolor[i];}
+    void prefetch(int i) const {if (~s.child[i]) __builtin_prefetch(&root[s.child[i]]);}
+};
+
+/** Accesses the children of a node in the octree format with 64-bit child indices. */
+struct wide_node : direct_color {
+    typedef uint64_t index;
+    const wide_octree & s;
+    wide_node(index octnode) : s(wide_root[octnode]) {}
+    bool present(int i) const {return s.avgcolor[i]>=0;}
+    index child(int i) const {return s.child[i];}
+    uint32_t color(int i) const {return s.avgcolor[i];}
+    void prefetch(int i) const {if (~s.child[i]) __builtin_prefetch(&wide_root[s.child[i]]);}
+};
+
+/** Accesses the children of a node in a packed octree file, through the block cache of the current thread. 
+ * The node is copied, as its block might be evicted while traversing its children.
+ */
+struct packed_node : direct_color {
+    typedef uint32_t index;
+    octree s;
+    packed_node(index octnode) {if (~octnode) s = *cache->get(packed_file, octnode);}
+    bool present(int i) const {return s.avgcolor[i]>=0;}
+    index child(int i) const {return s.child[i];}
+    uint32_t color(int i) const {return s.avgcolor[i];}
+    void prefetch(int) const {}
+};
+
+/** Accesses the children of a node through the pager. 
+ * Children whose page is not resident yet are reported as leaves, such that their average color is drawn.
+ */
+template<typename node>
+struct paged_node : node {
+    paged_node(typename node::index octnode) : node(octnode) {}
+    typename node::index child(int i) const {
+        typename node::index c = node::child(i);
+        return (~c && !pager->resident(c)) ? ~(typename node::index)0 : c;
+    }
+};
+
+/** Accesses the children of a node in the compact octree format. 
+ * Leaves are reported with child index ~0u, as in the original format.
+ */
+struct compact_node : direct_color {
+    typedef uint32_t index;
+    const compact_octree * first;
+    uint32_t mask;
+    compact_node(index octnode) : first(NULL), mask(0) {
+        if (~octnode) {
+            first = &compact_root[compact_root[octnode].child];
+            mask = compact_root[octnode].data >> 24;
+        }
+    }
+    const compact_octree & get(int i) const {return first[__builtin_popcount(mask & ((1u<<i)-1))];}
+    bool present(int i) const {return mask>>i&1;}
+    index child(int i) const {return get(i).data>>24 ? (index)(&get(i) - compact_root) : ~0u;}
+    uint32_t color(int i) const {return get(i).data & 0xffffff;}
+    void prefetch(int i) const {if (get(i).data>>24) __builtin_prefetch(&compact_root[get(i).child]);}
+};
+
+/** Expands a 16-bit RGB565 color to 24-bit RGB. */
+static inline uint32_t expand_color(uint16_t c) {
+    uint32_t r = c>>11, g = c>>5&0x3f, b = c&0x1f;
+    return (r<<3|r>>2)<<16 | (g<<2|g>>4)<<8 | (b<<3|b>>2);
+}
+
+static inline uint32_t expand_color(uint32_t c) {
+    return c;
+}
+
+/** Accesses the children of a node in the split octree format, with colors of type color_t. 
+ * The colors are stored apart from the nodes and are only read for the children that are drawn, 
+ * as color_ref is the position of the color in the array of colors.
+ */
+template<typename color_t>
+struct split_node {
+    typedef uint32_t index;
+    typedef uint64_t color_ref;
+    const split_octree & s;
+    const uint32_t octnode;
+    split_node(index octnode) : s(split_root[octnode]), octnode(octnode) {}
+    bool present(int i) const {return s.child[i] != SPLIT_EMPTY;}
+    index child(int i) const {return s.child[i];}
+    color_ref color(int i) const {return (uint64_t)octnode*8 + i;}
+    static uint32_t resolve(color_ref color) {return expand_color(((const color_t*)split_colors)[color]);}
+    void prefetch(int i) const {if (s.child[i] < SPLIT_EMPTY) __builtin_prefetch(&split_root[s.child[i]]);}
+};
+
 /** Returns true if quadtree node is rendered 
  * Function is assumed to be called only if quadtree node is not yet fully rendered.
  * The bounds array is ordered as DELTA.
  * C is the corner that is furthest away from the camera.
  * Furthermore, pos is the location of the center of the octree node, relative to the viewer in octree space.
+ * If wide is set, the children are tested in a single batch using AVX2.
+ * The node type determines the file format of the octree.
  */
+template<bool wide, typename node>
 static bool traverse(
-    const int32_t quadnode, const uint32_t octnode, const uint32_t octcolor, 
+    const int32_t quadnode, const typename node::index octnode, const typename node::color_ref octcolor, 
     const v4si bound, const v4si dx, const v4si dy, const v4si dz,  
     const v4si pos, const int depth
 ){    
@@ -79,33 +276,43 @@ static bool traverse(
     v4si gtz;
     v4si new_bound;
     
-    // Recursion
-    if (depth>=0 && bound[1] - bound[0] <= 2<<SCENE_DEPTH) {
+    // Recursion, always descending from the root, as it has no color of its own.
+    if (depth>=0 && (depth==SCENE_DEPTH-1 || bound[1] - bound[0] <= detail_limit(pos))) {
         // Traverse octree
-        octree &s = root[octnode];
+        const node s(octnode);
         v4si octant = -(pos<0);
         int furthest = (octant[0]<<2)|(octant[1]<<1)|(octant[2]<<0);
+        uint32_t visible = wide ? child_mask_avx2(bound, dx, dy, dz) : ~0u;
+        if (render_prefetch && ~octnode) {
+            // Fetch the nodes of the children before visiting them in front to back order.
+            for (int i = 0; i<8; i++) {
+                if ((visible>>i&1) && s.present(i)) s.prefetch(i);
+            }
+        }
         for (int k = 0; k<8; k++) {
             int i = furthest^k;
-            if (~octnode && s.avgcolor[i]<0) continue;
+            if (!(visible>>i&1)) continue;
+            if (~octnode && !s.present(i)) continue;
             new_bound = bound<<1;
             if ((C^i)&DX) new_bound += dx;
             if ((C^i)&DY) new_bound += dy;
             if ((C^i)&DZ) new_bound += dz;
-            ltz = (new_bound - (dx<0)*dx - (dy<0)*dy - (dz<0)*dz)<0;
-            gtz = (new_bound - (dx>0)*dx - (dy>0)*dy - (dz>0)*dz)>0;
-            if ((ltz[0] & gtz[1] & ltz[2] & gtz[3]) == 0) continue; // frustum occlusion
+            if (!wide) {
+                ltz = (new_bound - (dx<0)*dx - (dy<0)*dy - (dz<0)*dz)<0;
+                gtz = (new_bound - (dx>0)*dx - (dy>0)*dy - (dz>0)*dz)>0;
+                if ((ltz[0] & gtz[1] & ltz[2] & gtz[3]) == 0) continue; // frustum occlusion
+            }
             if (~octnode) {
-                if (traverse(quadnode, s.child[i], s.avgcolor[i], new_bound, dx, dy, dz, pos + (DELTA[i]<<depth), depth-1)) return true;
+                if (traverse<wide,node>(quadnode, s.child(i), s.color(i), new_bound, dx, dy, dz, pos + (DELTA[i]<<depth), depth-1)) return true;
             } else {
-                if (traverse(quadnode, ~0u, octcolor, new_bound, dx, dy, dz, pos + (DELTA[i]<<depth), depth-1)) return true;
+                if (traverse<wide,node>(quadnode, ~(typename node::index)0, octcolor, new_bound, dx, dy, dz, pos + (DELTA[i]<<depth), depth-1)) return true;
             }
         }
         return false;
     } else {
         // Traverse quadtree 
         for (int i = 4; i<8; i++) {
-            if (!face.map[quadnode*4+i]) continue;
+            if (!face->map[quadnode*4+i]) continue;
             new_bound = (bound + __builtin_shuffle(bound,quad_permutation[i])) >> 1;
             v4si new_dx = (dx + __builtin_shuffle(dx,quad_permutation[i])) >> 1;
             v4si new_dy = (dy + __builtin_shuffle(dy,quad_permutation[i])) >> 1;
@@ -113,19 +320,50 @@ static bool traverse(
             ltz = (new_bound - (new_dx<0)*new_dx - (new_dy<0)*new_dy - (new_dz<0)*new_dz)<0;
             gtz = (new_bound - (new_dx>0)*new_dx - (new_dy>0)*new_dy - (new_dz>0)*new_dz)>0;
             if ((ltz[0] & gtz[1] & ltz[2] & gtz[3]) == 0) continue; // frustum occlusion
-            if (quadnode<(int)quadtree::L)
-                traverse(quadnode*4+i, octnode, octcolor, new_bound, new_dx, new_dy, new_dz, pos, depth); 
+            if (quadnode*4+i < quad_leaf)
+                traverse<wide,node>(quadnode*4+i, octnode, octcolor, new_bound, new_dx, new_dy, new_dz, pos, depth); 
+            else if (quadnode*4+i >= (int)quadtree::M)
+                face->set_face(quadnode*4+i, node::resolve(octcolor)); // Rendering
             else
-                face.set_face(quadnode*4+i, octcolor); // Rendering
+                face->set_block(quadnode*4+i, node::resolve(octcolor)); // Coarse rendering
         }
         if (quadnode>=0) {
-            face.compute(quadnode);
-            return !face.map[quadnode];
+            face->compute(quadnode);
+            return !face->map[quadnode];
         } else {
-            return face.children[0]==0;
+            return face->children[0]==0;
         }
     }
 }
+
+/** Traverses the octree, starting at its root and the root of the quadtree. */
+template<bool wide, typename node>
+static void traverse_root_node(const v4si bound, const v4si dx, const v4si dy, const v4si dz, const v4si pos) {
+    traverse<wide,node>(-1, 0, 0, bound, dx, dy, dz, pos, SCENE_DEPTH-1);
+}
+
+typedef void (*traverse_function)(const v4si bound, const v4si dx, const v4si dy, const v4si dz, const v4si pos);
+
+/** Returns true if the processor supports AVX2. */
+static bool detect_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+static const bool use_avx2 = detect_avx2();
+
+/** Selects the version of traverse() for the given node type, using AVX2 if the processor supports it. */
+template<typename node>
+static traverse_function select_traverse() {
+    return use_avx2 ? traverse_root_node<true,node> : traverse_root_node<false,node>;
+}
+
+/** The version of traverse() that is used for the current octree file. */
+static traverse_function traverse_root;
     
 static const double quadtree_bounds[] = {
     frustum::left  /(double)frustum::near,
@@ -134,33 +372,197 @@ static const double quadtree_bounds[] = {
     frustum::top   /(double)frustum::near,
 };
 
-/** Render the octree to the OpenGL cubemap texture. 
+/** Bounds of the 90 degree view pyramid of a cubemap face. */
+static const double cubemap_bounds[] = {-1, 1, -1, 1};
+
+/** Orientations of the cubemap faces, in the order +X, -X, +Y, -Y, +Z, -Z. 
+ * The rows are the right, up and forward directions of the face.
  */
-void octree_draw(octree_file * file) {
-    Timer t_global;
-    
-    double timer_prepare;
-    double timer_query;
-    double timer_transfer;
+static const glm::dmat3 cubemap_view[6] = {
+    glm::dmat3( 0, 0, 1,   0, 1, 0,  -1, 0, 0),
+    glm::dmat3( 0, 0,-1,   0, 1, 0,   1, 0, 0),
+    glm::dmat3( 1, 0, 0,   0, 0, 1,   0,-1, 0),
+    glm::dmat3( 1, 0, 0,   0, 0,-1,   0, 1, 0),
+    glm::dmat3( 1, 0, 0,   0, 1, 0,   0, 0, 1),
+    glm::dmat3(-1, 0, 0,   0, 1, 0,   0, 0,-1),
+};
+
+bool render_cubemap = false;
+double render_budget = 0;
+
+namespace {
+    int view_width;
+    int view_height;
     
-    root = file->root;
+    int32_t * cubemap_colors[6];
+    glm::dvec3 cubemap_position;
+    uint32_t cubemap_scene = 0;
+    uint32_t cubemap_revision = 0;
+    uint64_t cubemap_pages = 0;
+}
+
+/** Quadtree level at which the screen is split into tiles for parallel rendering.
+ * Level 4 gives tiles of 32x32 pixels, such that there are plenty of tiles per thread.
+ */
+static const unsigned int TILE_LEVEL = 4;
+static const unsigned int TILE_FIRST = ((4<<TILE_LEVEL<<TILE_LEVEL)-4)/3;
+static const unsigned int TILE_COUNT = 4<<TILE_LEVEL<<TILE_LEVEL;
+static const unsigned int TILE_PIXELS = quadtree::SIZE*quadtree::SIZE >> TILE_LEVEL >> TILE_LEVEL >> 2;
+
+/** Number of quadtree levels that are skipped by the coarse pass of budgeted rendering (8x8 pixel blocks). */
+static const unsigned int COARSE_LEVELS = 3;
+
+struct render_job {
+    pthread_t thread;
+    int id;
+    quadtree * face;
+    block_cache * cache;
+    bool build;
+    double time_limit;
+    int refined;
+    v4si bound, dx, dy, dz, pos;
+};
+
+namespace {
+    /** The worker that renders each tile, or -1 if the tile is not rendered. */
+    int tile_owner[TILE_COUNT];
     
-    Timer t_prepare;
-        
-    // Prepare the occlusion quadtree
-    face.build(SCREEN_WIDTH, SCREEN_HEIGHT);
+    /** The tiles of the current batch of budgeted rendering, in the order in which they are refined. */
+    int batch[TILE_COUNT];
+    int batch_size;
+    /** Time in milliseconds after which the workers stop refining the tiles of the batch, or 0 if no batch is refined. */
+    double batch_time_limit = 0;
+    /** Number of tiles of the batch that were refined. */
+    int batch_refined;
+}
+
+/** Renders the tiles of the screen that are assigned to the given job.
+ * Each worker has its own occlusion quadtree, in which the tiles of other workers 
+ * are marked as already rendered. The quadtree is only built for the first instance
+ * of the scene, such that the following instances are occluded by the previous ones.
+ * 
+ * If the job has a time limit, the worker clears and renders its tiles of the batch one at a time,
+ * and leaves the remaining tiles closed, hence coarse, once the time limit has passed.
+ */
+static void * render_tiles(void * arg) {
+    render_job &job = *(render_job*)arg;
+    face = job.face;
+    cache = job.cache;
+    if (job.build) {
+        face->build(view_width, view_height);
+        for (unsigned int i=0; i<TILE_COUNT; i++) {
+            if (tile_owner[i] != job.id || job.time_limit > 0) face->map[TILE_FIRST+i] = 0;
+        }
+        for (int i=TILE_FIRST-1; i>=0; i--) {
+            face->compute(i);
+        }
+    }
+    if (job.time_limit > 0) {
+        Timer t;
+        for (int j=0; j<batch_size; j++) {
+            int tile = batch[j];
+            if (tile_owner[tile] != job.id) continue;
+            if (t.elapsed() >= job.time_limit) break;
+            std::fill(face->face + tile*TILE_PIXELS, face->face + (tile+1)*TILE_PIXELS, -1);
+            // Open the tile and its ancestors, whose parent is node/4-1.
+            for (int node = TILE_FIRST+tile; node >= 0; node = node/4-1) {
+                face->map[node] = 1;
+            }
+            traverse_root(job.bound, job.dx, job.dy, job.dz, job.pos);
+            job.refined++;
+        }
+    } else {
+        traverse_root(job.bound, job.dx, job.dy, job.dz, job.pos);
+    }
+    return NULL;
+}
+
+/** Returns the block cache of the given render thread. */
+static block_cache * thread_cache(int id) {
+    while ((int)caches.size() <= id) caches.push_back(new block_cache());
+    caches[id]->resize(cache_blocks, cache_block_nodes);
+    return caches[id];
+}
+
+/** Renders the tiles given by tile_owner, using render_threads threads. 
+ */
+static void traverse_tiles(bool build, const v4si bound, const v4si dx, const v4si dy, const v4si dz, const v4si pos) {
+    static quadtree * faces = NULL;
+    static int face_count = 0;
+    if (face_count < render_threads) {
+        delete[] faces;
+        faces = new quadtree[render_threads];
+        face_count = render_threads;
+    }
     
-    timer_prepare = t_prepare.elapsed();
+    render_job job[render_threads];
+    for (int i=0; i<render_threads; i++) {
+        job[i].id = i;
+        job[i].face = &faces[i];
+        job[i].face->face = main_face.face;
+        job[i].cache = thread_cache(i);
+        job[i].build = build;
+        // Only the first instance refines the tiles of a batch one at a time, the others draw into the tiles that were opened.
+        job[i].time_limit = build ? batch_time_limit : 0;
+        job[i].refined = 0;
+        job[i].bound = bound;
+        job[i].dx = dx;
+        job[i].dy = dy;
+        job[i].dz = dz;
+        job[i].pos = pos;
+        if (i>0 && pthread_create(&job[i].thread, NULL, render_tiles, &job[i])) {
+            perror("Could not create render thread"); 
+            exit(1);
+        }
+    }
+    render_tiles(&job[0]);
+    for (int i=1; i<render_threads; i++) {
+        pthread_join(job[i].thread, NULL);
+    }
+    for (int i=0; i<render_threads; i++) {
+        batch_refined += job[i].refined;
+    }
+    face = &main_face;
+}
 
-    Timer t_query;
+/** Clears the given color buffer and prepares the occlusion quadtree for a view of the given size.
+ * When rendering in parallel, the tiles are assigned round robin in quadtree order,
+ * which spreads each worker's tiles evenly over the screen.
+ */
+static void prepare_view(int32_t * colors, int width, int height) {
+    view_width = width;
+    view_height = height;
+    face = &main_face;
+    face->face = colors;
+    face->clear_face();
+    if (render_threads <= 1) {
+        face->build(width, height);
+    } else {
+        for (unsigned int i=0; i<TILE_COUNT; i++) {
+            tile_owner[i] = i%render_threads;
+        }
+    }
+}
+
+/** Renders the octree of the selected file as seen from eye with the given orientation, both in octree space.
+ * The view pyramid is given by the bounds of the quadtree, as x/z and y/z ratios in camera space.
+ * If tiled is set, or when rendering in parallel, only the tiles given by tile_owner are rendered.
+ * The per-thread quadtrees of parallel rendering are only built if build is set.
+ */
+static void render_instance(const glm::dmat3 & view, const glm::dvec3 & eye, const double quadtree_bounds[4], bool tiled, bool build) {
+    lod_limit = (2<<SCENE_DEPTH) / max(render_lod, 1.0/8);
+    lod_shift = -1;
+    if (render_lod_distance >= 1) {
+        // The distance is compared by shifting, hence it is rounded to the nearest power of two.
+        lod_shift = (int)std::lround(std::log2(render_lod_distance));
+    }
     
-    // Do the actual rendering of the scene (i.e. execute the query).
     v4si bounds[8];
     int max_z=-1<<31;
     for (int i=0; i<8; i++) {
         // Compute position of octree corners in camera-space
         v4si vertex = DELTA[i]<<SCENE_DEPTH;
-        glm::dvec3 coord = orientation * (glm::dvec3(vertex[0], vertex[1], vertex[2]) - position);
+        glm::dvec3 coord = view * (glm::dvec3(vertex[0], vertex[1], vertex[2]) - eye);
         v4si b = {
             (int)(coord.z*quadtree_bounds[0] - coord.x),
             (int)(coord.z*quadtree_bounds[1] - coord.x),
@@ -173,26 +575,377 @@ void octree_draw(octree_file * file) {
             C = i;
         }
     }
-    v4si pos = {(int)position.x, (int)position.y, (int)position.z};
-    traverse(
-        -1, 0, 0, bounds[C], 
-        (bounds[C^DX]-bounds[C]), 
-        (bounds[C^DY]-bounds[C]), 
-        (bounds[C^DZ]-bounds[C]), 
-        -pos, SCENE_DEPTH-1
-    );
-    
+    for (int i=0; i<8; i++) {
+        child_dx[i] = -!!((C^i)&DX);
+        child_dy[i] = -!!((C^i)&DY);
+        child_dz[i] = -!!((C^i)&DZ);
+    }
+    v4si pos = {(int)eye.x, (int)eye.y, (int)eye.z};
+    if (tiled || render_threads > 1) {
+        traverse_tiles(
+            build,
+            bounds[C], 
+            (bounds[C^DX]-bounds[C]), 
+            (bounds[C^DY]-bounds[C]), 
+            (bounds[C^DZ]-bounds[C]), 
+            -pos
+        );
+    } else {
+        cache = thread_cache(0);
+        traverse_root(
+            bounds[C], 
+            (bounds[C^DX]-bounds[C]), 
+            (bounds[C^DY]-bounds[C]), 
+            (bounds[C^DZ]-bounds[C]), 
+            -pos
+        );
+    }
+}
+
+/** Returns true if the nodes of the given file are read through a pager.
+ * Files that are being edited are read directly, as the pager maps the file on disk.
+ */
+static bool paged(const octree_file * file) {
+    return render_paging > 0 && !file->edited && (file->format == OCTREE_NODES || file->format == OCTREE_WIDE);
+}
+
+/** Selects the node type and the nodes of the given file for traverse(). */
+static void select_file(octree_file * file) {
+    root = file->root;
+    pager = NULL;
+    if (paged(file)) {
+        for (unsigned int i=0; i<pagers.size(); i++) {
+            if (pager_files[i] == file->id) pager = pagers[i];
+        }
+        if (!pager) {
+            pager = new octree_pager(file, pager_budget);
+            pagers.push_back(pager);
+            pager_files.push_back(file->id);
+        }
+        // Read the nodes through the mapping of the pager.
+        root = (octree*)pager->nodes;
+    }
+    switch (file->format) {
+        case OCTREE_COMPACT:
+            compact_root = file->compact_root;
+            traverse_root = select_traverse<compact_node>();
+            break;
+        case OCTREE_WIDE:
+            wide_root = (wide_octree*)root;
+            traverse_root = pager ? select_traverse<paged_node<wide_node> >() : select_traverse<wide_node>();
+            break;
+        case OCTREE_SPLIT:
+            split_root = file->split_root;
+            split_colors = file->split_colors();
+            traverse_root = select_traverse<split_node<uint32_t> >();
+            break;
+        case OCTREE_SPLIT16:
+            split_root = file->split_root;
+            split_colors = file->split_colors();
+            traverse_root = select_traverse<split_node<uint16_t> >();
+            break;
+        case OCTREE_PACKED:
+            packed_file = file;
+            traverse_root = select_traverse<packed_node>();
+            break;
+        default:
+            traverse_root = pager ? select_traverse<paged_node<octree_node> >() : select_traverse<octree_node>();
+            break;
+    }
+}
+
+/** Sizes the block caches for the largest blocks of the packed files of the given scene. */
+static void size_caches(const scene & s) {
+    cache_block_nodes = PACK_BLOCK_NODES;
+    for (unsigned int i=0; i<s.files.size(); i++) {
+        if (s.files[i]->format == OCTREE_PACKED) cache_block_nodes = max(cache_block_nodes, s.files[i]->header->block_nodes);
+    }
+    cache_blocks = ((uint64_t)render_cache<<20) / (cache_block_nodes * sizeof(octree));
+}
+
+/** Splits the paging budget between the paged files of the given scene.
+ * Deletes the pagers of files that are not part of the scene, and all of them if the budget of a pager changed.
+ */
+static void release_pagers(const scene & s) {
+    uint64_t files = 0;
+    for (unsigned int j=0; j<s.files.size(); j++) {
+        if (paged(s.files[j])) files++;
+    }
+    uint64_t budget = files ? ((uint64_t)render_paging<<20) / files : 0;
+    bool resized = budget != pager_budget;
+    pager_budget = budget;
+    for (unsigned int i=0; i<pagers.size(); ) {
+        bool used = false;
+        for (unsigned int j=0; j<s.files.size(); j++) {
+            if (s.files[j]->id == pager_files[i]) used = true;
+        }
+        if (used && render_paging > 0 && !resized) {
+            i++;
+        } else {
+            delete pagers[i];
+            pagers.erase(pagers.begin() + i);
+            pager_files.erase(pager_files.begin() + i);
+        }
+    }
+}
+
+/** Instances whose bounding cube is further away are not drawn, as their coordinates would overflow in traverse(). */
+static const double INSTANCE_RANGE = 1<<29;
+
+/** Renders the instances of the current scene as seen from position with the given orientation.
+ * The instances are rendered front to back into the same occlusion quadtree, 
+ * such that nearer instances occlude the ones behind them.
+ */
+static void render_view(const glm::dmat3 & view, const double quadtree_bounds[4], bool tiled=false) {
+    const std::vector<scene_instance> & instances = current_scene->instances;
+    std::vector<std::pair<double, int> > order;
+    for (unsigned int i=0; i<instances.size(); i++) {
+        // Distance from the camera to the bounding cube of the instance.
+        glm::dvec3 d = glm::abs(position - instances[i].offset);
+        double half = 1<<SCENE_DEPTH;
+        glm::dvec3 outside(max(d.x - half, 0.0), max(d.y - half, 0.0), max(d.z - half, 0.0));
+        double distance = glm::length(outside);
+        if (distance < INSTANCE_RANGE) order.push_back(std::make_pair(distance, i));
+    }
+    std::sort(order.begin(), order.end());
+    for (unsigned int k=0; k<order.size(); k++) {
+        // Stop once every pixel is drawn.
+        if (k>0 && !tiled && render_threads <= 1 && main_face.children[0]==0) break;
+        const scene_instance & instance = instances[order[k].second];
+        select_file(instance.file);
+        if (instance.orientation == glm::dmat3(1)) {
+            render_instance(view, position - instance.offset, quadtree_bounds, tiled, k==0);
+        } else {
+            render_instance(
+                view * instance.orientation, 
+                glm::transpose(instance.orientation) * (position - instance.offset), 
+                quadtree_bounds, tiled, k==0
+            );
+        }
+    }
+}
+
+/** Renders tiles at full detail, starting at the center of the screen, until the time budget is spent.
+ * The tiles are rendered in batches, whose size is based on the average time per tile of the batches so far,
+ * and at most twice that of the previous batch. The workers check the time between the tiles of a batch, 
+ * such that a batch that takes longer than estimated stops at the end of the budget.
+ * Returns the number of tiles that were rendered, which is 0 if the budget was spent before the first batch.
+ */
+static int refine_tiles(Timer & timer, double budget) {
+    static int order[TILE_COUNT];
+    static int order_count = 0;
+    if (order_count == 0) {
+        // Sort the visible tiles by their distance to the center of the screen.
+        const int size = quadtree::SIZE >> TILE_LEVEL >> 1;
+        std::pair<int, int> tiles[TILE_COUNT];
+        for (unsigned int i=0; i<TILE_COUNT; i++) {
+            int x = 0, y = 0;
+            for (unsigned int j=0; j<=TILE_LEVEL; j++) {
+                x |= ((i >> (2*j))   & 1) << j;
+                y |= ((i >> (2*j+1)) & 1) << j;
+            }
+            x = x*size + size/2 - SCREEN_WIDTH/2;
+            y = y*size + size/2 - SCREEN_HEIGHT/2;
+            if (x < SCREEN_WIDTH/2 && y < SCREEN_HEIGHT/2) {
+                tiles[order_count++] = std::make_pair(x*x + y*y, i);
+            }
+        }
+        std::sort(tiles, tiles+order_count);
+        for (int i=0; i<order_count; i++) {
+            order[i] = tiles[i].second;
+        }
+    }
     
-    timer_query = t_query.elapsed();
+    double spent = 0;
+    int done = 0;
+    int limit = render_threads;
+    while (done < order_count) {
+        // The coarse image may already have used the whole budget.
+        double remaining = budget - timer.elapsed();
+        if (remaining <= 0) break;
+        int n = min(limit, order_count - done);
+        if (spent > 0) {
+            n = min<double>(n, remaining * done / spent);
+            if (n <= 0) break;
+        }
+        
+        for (unsigned int i=0; i<TILE_COUNT; i++) {
+            tile_owner[i] = -1;
+        }
+        for (int i=0; i<n; i++) {
+            batch[i] = order[done+i];
+            tile_owner[batch[i]] = i%render_threads;
+        }
+        batch_size = n;
+        batch_time_limit = remaining;
+        batch_refined = 0;
+        
+        Timer t_batch;
+        render_view(orientation, quadtree_bounds, true);
+        spent += t_batch.elapsed();
+        done += batch_refined;
+        if (batch_refined < n) break;
+        limit = 2*n;
+    }
+    batch_time_limit = 0;
+    return done;
+}
+
+/** Returns the number of pages loaded by the pagers of the current scene. */
+uint64_t render_pages_loaded() {
+    uint64_t loaded = 0;
+    for (unsigned int i=0; i<pagers.size(); i++) {
+        loaded += __atomic_load_n(&pagers[i]->loaded, __ATOMIC_RELAXED);
+    }
+    return loaded;
+}
 
-    Timer t_transfer;
+/** Returns the sum of the revisions of the files of the scene, which changes whenever one of them is edited. */
+static uint32_t scene_revision(const scene & s) {
+    uint32_t revision = 0;
+    for (unsigned int i=0; i<s.files.size(); i++) {
+        revision += s.files[i]->revision;
+    }
+    return revision;
+}
+
+/** Returns the number of block cache hits and misses of all render threads since the program started. */
+void render_cache_stats(uint64_t & hits, uint64_t & misses) {
+    hits = misses = 0;
+    for (unsigned int i=0; i<caches.size(); i++) {
+        hits += caches[i]->hits;
+        misses += caches[i]->misses;
+    }
+}
+
+/** Draws the screen by sampling the cubemap faces in the direction of each pixel.
+ */
+static void reproject_cubemap() {
+    const glm::dmat3 inverse = glm::transpose(orientation);
+    const glm::dvec3 step = inverse * glm::dvec3(1, 0, 0);
+    const double half = quadtree::SIZE/2;
+    for (int y=0; y<SCREEN_HEIGHT; y++) {
+        glm::dvec3 dir = inverse * glm::dvec3(frustum::left + 0.5, frustum::top - y - 0.5, frustum::near);
+        uint32_t * row = screen->pixels + y*SCREEN_WIDTH;
+        for (int x=0; x<SCREEN_WIDTH; x++, dir += step) {
+            double ax = std::abs(dir.x), ay = std::abs(dir.y), az = std::abs(dir.z);
+            int f;
+            if (ax >= ay && ax >= az) {
+                f = dir.x<0;
+            } else if (ay >= az) {
+                f = 2 + (dir.y<0);
+            } else {
+                f = 4 + (dir.z<0);
+            }
+            glm::dvec3 d = cubemap_view[f] * dir;
+            int u = (int)(half + d.x/d.z*half);
+            int v = (int)(half - d.y/d.z*half);
+            u = min(max(u, 0), (int)quadtree::SIZE-1);
+            v = min(max(v, 0), (int)quadtree::SIZE-1);
+            int32_t color = cubemap_colors[f][quadtree::morton_x[u] | quadtree::morton_y[v]];
+            if (color >= 0) row[x] = color;
+        }
+    }
+}
+
+/** Render the octree to the screen.
+ * The file is drawn as a scene with a single instance.
+ */
+void octree_draw(octree_file * file) {
+    static scene * single = NULL;
+    static uint32_t single_id = 0;
+    if (!single || single->files[0] != file || single_id != file->id) {
+        delete single;
+        single = new scene(file);
+        single_id = file->id;
+    }
+    octree_draw(*single);
+}
+
+/** Render the scene to the screen.
+ * If render_cubemap is set, the scene is rendered to the six faces of a cubemap instead, 
+ * which are reused until the camera position changes.
+ * Otherwise, if render_budget is set, a coarse image is rendered first, which is refined 
+ * tile by tile until render_budget milliseconds have passed.
+ */
+void octree_draw(const scene & s) {
+    Timer t_global;
+    
+    double timer_prepare = 0;
+    double timer_query = 0;
+    double timer_transfer;
+    int refined = -1;
     
-    // Send the image data to OpenGL.
-    // glTexImage2D( cubetargets[i], 0, 4, quadtree::SIZE, quadtree::SIZE, 0, GL_BGRA, GL_UNSIGNED_BYTE, face.face);
+    current_scene = &s;
+    size_caches(s);
+    release_pagers(s);
     
-    timer_transfer = t_transfer.elapsed();
+    if (render_cubemap) {
+        if (!cubemap_colors[0]) {
+            for (int i=0; i<6; i++) {
+                cubemap_colors[i] = new int32_t[quadtree::SIZE*quadtree::SIZE];
+            }
+        }
+        // The cubemap is also rendered again when pages have arrived that might be visible, or when the scene was edited.
+        if (cubemap_scene != s.id || cubemap_position != position || cubemap_pages != render_pages_loaded() || cubemap_revision != scene_revision(s)) {
+            cubemap_pages = render_pages_loaded();
+            cubemap_revision = scene_revision(s);
+            for (int i=0; i<6; i++) {
+                Timer t_prepare;
+                prepare_view(cubemap_colors[i], quadtree::SIZE, quadtree::SIZE);
+                timer_prepare += t_prepare.elapsed();
+                Timer t_query;
+                render_view(cubemap_view[i], cubemap_bounds);
+                timer_query += t_query.elapsed();
+            }
+            cubemap_scene = s.id;
+            cubemap_position = position;
+        }
+        
+        Timer t_transfer;
+        reproject_cubemap();
+        timer_transfer = t_transfer.elapsed();
+    } else if (render_budget > 0) {
+        Timer t_prepare;
+        prepare_view(face_colors, SCREEN_WIDTH, SCREEN_HEIGHT);
+        timer_prepare = t_prepare.elapsed();
+
+        // Render a coarse image and refine it while time remains.
+        Timer t_query;
+        quad_leaf = ((4<<2*(quadtree::dim-1-COARSE_LEVELS))-4)/3;
+        render_view(orientation, quadtree_bounds);
+        quad_leaf = quadtree::M;
+        refined = refine_tiles(t_global, render_budget);
+        timer_query = t_query.elapsed();
+
+        // Copy the rendered pixels to the screen.
+        Timer t_transfer;
+        main_face.draw(screen->pixels, SCREEN_WIDTH, SCREEN_HEIGHT);
+        timer_transfer = t_transfer.elapsed();
+    } else {
+        Timer t_prepare;
+        prepare_view(face_colors, SCREEN_WIDTH, SCREEN_HEIGHT);
+        timer_prepare = t_prepare.elapsed();
+
+        // Do the actual rendering of the scene (i.e. execute the query).
+        Timer t_query;
+        render_view(orientation, quadtree_bounds);
+        timer_query = t_query.elapsed();
+
+        // Copy the rendered pixels to the screen.
+        Timer t_transfer;
+        main_face.draw(screen->pixels, SCREEN_WIDTH, SCREEN_HEIGHT);
+        timer_transfer = t_transfer.elapsed();
+    }
             
-    std::printf("%7.2f | Prepare:%4.2f Query:%7.2f Transfer:%5.2f \n", t_global.elapsed(), timer_prepare, timer_query, timer_transfer);
+    // The render threads no longer read the pages that were evicted during this frame.
+    for (unsigned int i=0; i<pagers.size(); i++) pagers[i]->end_frame();
+
+    if (refined >= 0) {
+        std::printf("%7.2f | Prepare:%4.2f Query:%7.2f Transfer:%5.2f Refined:%4d \n", t_global.elapsed(), timer_prepare, timer_query, timer_transfer, refined);
+    } else {
+        std::printf("%7.2f | Prepare:%4.2f Query:%7.2f Transfer:%5.2f \n", t_global.elapsed(), timer_prepare, timer_query, timer_transfer);
+    }
 }
 
 // kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle; 
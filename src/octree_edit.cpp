@@ -0,0 +1,281 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "octree_edit.h"
+#include "octree_order.h"
+
+/** Amount of memory that is made writable at once when nodes are appended. */
+static const uint64_t EDIT_CHUNK = 1<<20;
+
+/** Starts editing the given file, whose nodes are replaced by the private copy of the editor until it is destroyed. */
+octree_editor::octree_editor(octree_file * file) : 
+    file(file), 
+    mixer(file->header && file->header->mix & OCTREE_MIX_WEIGHTED, file->header && file->header->mix & OCTREE_MIX_GAMMA) {
+    if (!file->header || file->format != OCTREE_NODES) {
+        fprintf(stderr, "Only octree files with a header and 32-bit child indices can be edited.\n");
+        exit(1);
+    }
+    if (mixer.weighted) {
+        fprintf(stderr, "Octree files with colors weighted by the number of points cannot be edited, as these numbers are not stored.\n");
+        exit(1);
+    }
+    assert(!file->edited);
+    uint64_t length = sizeof(octree_header) + file->size;
+    uint64_t pagesize = getpagesize();
+    committed = (length + pagesize - 1) & ~(pagesize - 1);
+    reserved = committed + OCTREE_EDIT_RESERVE;
+
+    // Reserve address space after the file, such that appended nodes directly follow the nodes of the file.
+    base = (char*)mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {perror("Could not reserve memory"); exit(1);}
+    // Pages of the file are copied by the kernel when they are first written.
+    if (mmap(base, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file->fd, 0) == MAP_FAILED) {
+        perror("Could not map file to memory");
+        exit(1);
+    }
+    header = (octree_header*)base;
+    root = (octree*)(base + sizeof(octree_header));
+    first_copy = header->nodes;
+
+    original_header = file->header;
+    original_root = file->root;
+    original_size = file->size;
+    file->header = header;
+    file->root = root;
+    file->edited = true;
+
+    // Models that repeat themselves have nodes that refer back to the root. These references are redirected 
+    // to a snapshot of the root, appended as a node of the file, such that only the edits change the root in place.
+    uint64_t snapshot = ~0ull;
+    for (uint64_t j=0; j<header->nodes; j++) {
+        for (int i=0; i<8; i++) {
+            if (root[j].child[i] != 0) continue;
+            if (!~snapshot) snapshot = append(root[0]);
+            if (!~snapshot) {
+                fprintf(stderr, "The octree has no child index left for a copy of its root, hence it cannot be edited.\n");
+                exit(1);
+            }
+            root[j].child[i] = snapshot;
+        }
+    }
+    first_copy = header->nodes;
+}
+
+/** Restores the nodes of the file, discarding the edits that were not saved. */
+octree_editor::~octree_editor() {
+    file->header = original_header;
+    file->root = original_root;
+    file->size = original_size;
+    file->edited = false;
+    file->revision++;
+    munmap(base, reserved);
+}
+
+/** Appends a copy of the given node and returns its index,
+ * or ~0 if the index does not fit in a 32-bit child index, in which case failed is set.
+ */
+uint64_t octree_editor::append(const octree & n) {
+    uint64_t index = header->nodes;
+    if (index > OCTREE_MAX_INDEX) {
+        failed = true;
+        return ~0ull;
+    }
+    uint64_t end = sizeof(octree_header) + (index+1) * sizeof(octree);
+    if (end > committed) {
+        if (committed + EDIT_CHUNK > reserved || mprotect(base + committed, EDIT_CHUNK, PROT_READ | PROT_WRITE)) {
+            perror("Could not allocate memory for edited nodes");
+            exit(1);
+        }
+        committed += EDIT_CHUNK;
+    }
+    root[index] = n;
+    header->nodes++;
+    file->size = header->nodes * sizeof(octree);
+    return index;
+}
+
+/** Returns the index of a node that can be changed in place of the given node, copying it if it belongs to the file.
+ * The root is changed in place, as no node refers to it since the constructor redirected such references to its snapshot.
+ * Returns ~0 if the copy could not be appended.
+ */
+uint64_t octree_editor::writable(uint64_t node) {
+    if (node == 0 || node >= first_copy) return node;
+    return append(root[node]);
+}
+
+/** Applies the current edit to the children of the given writable node,
+ * whose cell starts at the given corner and spans 2^layer points in each direction.
+ * Returns the new average color of the node, or -1 if it became empty.
+ * If a node cannot be appended, the remaining children are left unchanged, such that the octree stays consistent.
+ */
+int32_t octree_editor::edit_node(uint64_t node, const uint32_t corner[3], int layer) {
+    uint64_t half = 1ull << (layer-1);
+    bool bottom = layer-1 <= (int)header->bottom_layer;
+    for (int i=0; i<8 && !failed; i++) {
+        uint32_t c[3] = {
+            (uint32_t)(corner[0] + (i&4 ? half : 0)),
+            (uint32_t)(corner[1] + (i&2 ? half : 0)),
+            (uint32_t)(corner[2] + (i&1 ? half : 0)),
+        };
+        bool overlaps = true, inside = true;
+        for (int j=0; j<3; j++) {
+            if (c[j] + half <= box[j*2] || c[j] >= box[j*2+1]) overlaps = false;
+            if (c[j] < box[j*2] || c[j] + half > box[j*2+1]) inside = false;
+        }
+        if (!overlaps) continue;
+
+        octree & n = root[node];
+        bool present = n.avgcolor[i] >= 0;
+        bool leaf = !~n.child[i];
+        if (inside || bottom) {
+            // The child is replaced as a whole.
+            if (op == INSERT) {
+                n.child[i] = ~0u;
+                n.avgcolor[i] = color;
+                continue;
+            }
+            if (op == REMOVE) {
+                n.child[i] = ~0u;
+                n.avgcolor[i] = -1;
+                continue;
+            }
+            if (!present) continue;
+            if (leaf) {
+                n.avgcolor[i] = color;
+                continue;
+            }
+        } else if (!present) {
+            if (op != INSERT) continue;
+            octree empty;
+            for (int j=0; j<8; j++) {
+                empty.child[j] = ~0u;
+                empty.avgcolor[j] = -1;
+            }
+            uint64_t index = append(empty);
+            if (!~index) break;
+            n.child[i] = index;
+        } else if (leaf) {
+            // Split the filled cell, such that part of it can be changed.
+            octree filled;
+            for (int j=0; j<8; j++) {
+                filled.child[j] = ~0u;
+                filled.avgcolor[j] = n.avgcolor[i];
+            }
+            uint64_t index = append(filled);
+            if (!~index) break;
+            n.child[i] = index;
+        }
+
+        uint64_t child = writable(n.child[i]);
+        if (!~child) break;
+        int32_t avg = edit_node(child, c, layer-1);
+        // The reference is still valid, as appending never moves the nodes.
+        n.child[i] = avg < 0 ? ~0u : child;
+        n.avgcolor[i] = avg;
+    }
+    const octree & n = root[node];
+    for (int i=0; i<8; i++) {
+        if (n.avgcolor[i]>=0) return mixer.average(n, NULL);
+    }
+    return -1;
+}
+
+/** Applies the given operation to the box and computes the colors along the changed paths.
+ * Returns false without changes if the box is empty or inverted along one of the axes.
+ * Returns false if the octree ran out of 32-bit child indices, in which case the edit is only partially applied.
+ */
+bool octree_editor::edit(const uint32_t b[6], operation o, int32_t c) {
+    for (int j=0; j<3; j++) {
+        if (b[j*2] >= b[j*2+1]) return false;
+    }
+    memcpy(box, b, sizeof(box));
+    op = o;
+    color = c;
+    failed = false;
+    uint32_t corner[3] = {0, 0, 0};
+    edit_node(0, corner, header->depth);
+    if (op == INSERT) {
+        // Grow the bounds by the part of the box that lies within the octree.
+        uint64_t size = 1ull << header->depth;
+        uint64_t lo[3], hi[3];
+        bool empty = false;
+        for (int j=0; j<3; j++) {
+            lo[j] = std::min<uint64_t>(box[j*2], size);
+            hi[j] = std::min<uint64_t>(box[j*2+1], size);
+            if (lo[j] >= hi[j]) empty = true;
+        }
+        for (int j=0; j<3 && !empty; j++) {
+            header->bounds[j*2] = std::min<uint64_t>(header->bounds[j*2], lo[j]);
+            header->bounds[j*2+1] = std::max<uint64_t>(header->bounds[j*2+1], hi[j]);
+        }
+    }
+    file->revision++;
+    return !failed;
+}
+
+/** Fills the box with voxels of the given color. */
+bool octree_editor::insert(const uint32_t box[6], uint32_t color) {
+    return edit(box, INSERT, color & 0xffffff);
+}
+
+/** Removes the voxels within the box. */
+bool octree_editor::remove(const uint32_t box[6]) {
+    return edit(box, REMOVE, -1);
+}
+
+/** Changes the color of the voxels within the box, without adding voxels. */
+bool octree_editor::recolor(const uint32_t box[6], uint32_t color) {
+    return edit(box, RECOLOR, color & 0xffffff);
+}
+
+/**
+ * Writes the edited octree to the given file, which may be the file that is being edited.
+ * The nodes that are still reachable are stored in depth first order, such that
+ * the nodes that were replaced by copies are left out.
+ */
+void octree_editor::save(const char * filename) {
+    std::vector<uint64_t> sequence;
+    order_nodes(root, header->nodes, OCTREE_ORDER_DEPTH_FIRST, sequence);
+
+    // Write to a temporary file first, as the file being edited is still mapped.
+    char tmpfile[strlen(filename)+5];
+    sprintf(tmpfile, "%s.tmp", filename);
+    {
+        octree_file out(tmpfile, sequence.size() * sizeof(octree), OCTREE_NODES);
+        memcpy(out.header, header, sizeof(octree_header));
+        out.header->nodes = sequence.size();
+        out.header->order = OCTREE_ORDER_DEPTH_FIRST;
+        memset(out.header->layer_offset, 0, sizeof(out.header->layer_offset));
+        memset(out.header->layer_count, 0, sizeof(out.header->layer_count));
+        reorder_nodes(root, header->nodes, sequence, out.root);
+    }
+    if (rename(tmpfile, filename)) {
+        perror("Could not replace the octree file");
+        exit(1);
+    }
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
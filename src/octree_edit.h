@@ -0,0 +1,83 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_EDIT_H
+#define OCTREE_EDIT_H
+#include <stdint.h>
+#include "octree.h"
+#include "color_mixer.h"
+
+/** Address space reserved for the nodes that are appended by an octree_editor. */
+static const uint64_t OCTREE_EDIT_RESERVE = 1ull<<36;
+
+/**
+ * Edits the voxels of an octree file in memory, without changing the file on disk.
+ *
+ * The editor maps a private copy of the file and replaces the nodes of the octree_file by it,
+ * such that octree_draw shows the edits from the next frame on. Nodes of the file can be shared
+ * by several parents, hence a node is copied to the end of the nodes before it is changed for the first time.
+ * Nodes that refer back to the root, as in models that repeat themselves, keep referring to the root as it was 
+ * when the editor was created, such that an edit only changes the voxels within its box.
+ * Only the average colors of the nodes along the edited paths are computed again, 
+ * in the way that is recorded in the header of the file.
+ * Files whose colors are weighted by the number of points cannot be edited.
+ *
+ * Boxes are given in the coordinates of the points, as x1, x2, y1, y2, z1, z2 with x2, y2 and z2 exclusive,
+ * like the bounds in the header, which grow when voxels are inserted. Edits are done at the resolution of the lowest layer of nodes,
+ * such that a pruned cell is edited if the box overlaps with it.
+ * Only files with a header and 32-bit child indices can be edited.
+ * The edits return false for empty or inverted boxes, which are not applied, 
+ * and when the nodes no longer fit in 32-bit child indices,
+ * in which case the edit is only partially applied and should not be saved.
+ */
+struct octree_editor {
+    octree_editor(octree_file * file);
+    ~octree_editor();
+    bool insert(const uint32_t box[6], uint32_t color);
+    bool remove(const uint32_t box[6]);
+    bool recolor(const uint32_t box[6], uint32_t color);
+    bool insert(uint32_t x, uint32_t y, uint32_t z, uint32_t color) {uint32_t b[6] = {x, x+1, y, y+1, z, z+1}; return insert(b, color);}
+    bool remove(uint32_t x, uint32_t y, uint32_t z) {uint32_t b[6] = {x, x+1, y, y+1, z, z+1}; return remove(b);}
+    bool recolor(uint32_t x, uint32_t y, uint32_t z, uint32_t color) {uint32_t b[6] = {x, x+1, y, y+1, z, z+1}; return recolor(b, color);}
+    void save(const char * filename);
+private:
+    enum operation {INSERT, REMOVE, RECOLOR};
+    octree_file * file;
+    color_mixer mixer;
+    octree_header * original_header;
+    octree * original_root;
+    uint64_t original_size;
+    char * base;
+    uint64_t committed; ///< Number of bytes of the mapping that can be written.
+    uint64_t reserved;  ///< Size of the mapping.
+    octree_header * header;
+    octree * root;
+    uint64_t first_copy;
+    uint32_t box[6];
+    operation op;
+    int32_t color;
+    bool failed; ///< Set when a node could not be appended during the current edit.
+    bool edit(const uint32_t box[6], operation op, int32_t color);
+    uint64_t append(const octree & n);
+    uint64_t writable(uint64_t node);
+    int32_t edit_node(uint64_t node, const uint32_t corner[3], int layer);
+    octree_editor(octree_editor &);
+    octree_editor& operator=(octree_editor&);
+};
+
+#endif
@@ -19,45 +19,167 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include "octree.h"
 
 char * octree_available = NULL;
+int octree_map_options = 0;
+static uint32_t octree_file_count = 0;
+
+/** Returns true if the file name ends in '.svo', which is used for files in the compact format. */
+bool octree_file::is_compact(const char* filename) {
+    int length = strlen(filename);
+    return length>=4 && strcmp(filename+length-4, ".svo")==0;
+}
+
+/** Returns the size in bytes of the nodes of the given format, including their colors, or 1 for packed files. */
+uint32_t octree_file::node_size(octree_format format) {
+    switch (format) {
+        case OCTREE_COMPACT: return sizeof(compact_octree);
+        case OCTREE_WIDE: return sizeof(wide_octree);
+        case OCTREE_PACKED: return 1;
+        case OCTREE_SPLIT: return sizeof(split_octree) + 8*sizeof(uint32_t);
+        case OCTREE_SPLIT16: return sizeof(split_octree) + 8*sizeof(uint16_t);
+        default: return sizeof(octree);
+    }
+}
 
 /** 
  * Maps the given octree file to memory for reading and rendering.
  * 
  * It is unclear whether using MAP_PRIVATE or MAP_SHARED for mmap makes any difference.
  */
-octree_file::octree_file(const char* filename) : write(false) {
+octree_file::octree_file(const char* filename) : write(false), format(is_compact(filename) ? OCTREE_COMPACT : OCTREE_NODES), header(NULL), id(++octree_file_count), revision(0), edited(false) {
     fd = open(filename, O_RDONLY);
     if (fd == -1) {perror("Could not open file"); exit(1);}
-    size = lseek(fd, 0, SEEK_END);
-    assert(size % sizeof(octree) == 0);
-    root = (octree*)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
-    if (root == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+    length = lseek(fd, 0, SEEK_END);
+#ifdef MADV_HUGEPAGE
+    if (octree_map_options & OCTREE_HUGEPAGES) {
+        // File mappings are not backed by huge pages, hence the file is copied to anonymous memory.
+        base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {perror("Could not allocate memory"); exit(1);} 
+        madvise(base, length, MADV_HUGEPAGE);
+        for (uint64_t done = 0; done < length; ) {
+            ssize_t ret = pread(fd, base + done, length - done, done);
+            if (ret <= 0) {perror("Could not read file"); exit(1);}
+            done += ret;
+        }
+        mprotect(base, length, PROT_READ);
+    } else 
+#endif
+    {
+        base = (char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+        if (base == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+        if (octree_map_options & OCTREE_WILLNEED) {
+            madvise(base, length, MADV_WILLNEED);
+        }
+        if (octree_map_options & OCTREE_PRETOUCH) {
+            volatile char touch;
+            for (uint64_t i = 0; i < length; i += getpagesize()) {
+                touch = base[i];
+            }
+            (void)touch;
+        }
+    }
+    
+    // Files without header start with the root node, whose first child index cannot be equal to the magic number,
+    // as the file would then be much larger than the number of nodes given by the header.
+    octree_header * h = (octree_header*)base;
+    if (length >= sizeof(octree_header) && h->magic == OCTREE_MAGIC) {
+        if (h->version != OCTREE_VERSION) {fprintf(stderr, "Unsupported octree file version %u.\n", h->version); exit(1);}
+        if (h->format > OCTREE_SPLIT16) {fprintf(stderr, "Unsupported octree format %u.\n", h->format); exit(1);}
+        format = (octree_format)h->format;
+        header = h;
+        size = length - sizeof(octree_header);
+        bool valid;
+        if (format == OCTREE_PACKED) {
+            // The block index, with an extra entry for the end of the last block, must lie within the file.
+            valid = h->block_nodes > 0;
+            if (valid) {
+                uint64_t blocks = (h->nodes + h->block_nodes - 1) / h->block_nodes;
+                uint64_t * index = (uint64_t*)(base + sizeof(octree_header));
+                valid = (blocks+1)*8 <= size && index[blocks] <= size;
+            }
+        } else {
+            valid = h->nodes * node_size(format) == size;
+        }
+        if (!valid) {
+            fprintf(stderr, "Octree file is truncated or corrupt.\n"); 
+            exit(1);
+        }
+    } else {
+        size = length;
+    }
+    assert(size % node_size(format) == 0);
+    root = (octree*)(base + (length - size));
 }
 
 /** 
- * Creates an octree file with the given name and size for writing.
+ * Creates an octree file with the given name, size and node format for writing.
+ * The header is initialized, except for the description of the octree,
+ * and its checksum is computed when the file is closed.
  * 
  * This requires MAP_SHARED for mmap as changes must be written to disk
  */
-octree_file::octree_file(const char* filename, uint32_t size) : write(true), size(size) {
+octree_file::octree_file(const char* filename, uint64_t size, octree_format format) : write(true), format(format), size(size), id(++octree_file_count), revision(0), edited(false) {
+    assert(sizeof(octree_header) % sizeof(octree) == 0);
+    assert(sizeof(octree_header) % sizeof(wide_octree) == 0);
+    assert(sizeof(octree_header) % node_size(OCTREE_SPLIT16) == 0);
+    assert(size % node_size(format) == 0);
+    length = size + sizeof(octree_header);
     fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {perror("Could not open/creat file"); exit(1);}
-    int ret = ftruncate(fd, size);
+    int ret = ftruncate(fd, length);
     if (ret) {perror("Could not reserve diskspace"); exit(1);}
-    assert(size % sizeof(octree) == 0);
-    root = (octree*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (root == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+    base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {perror("Could not map file to memory"); exit(1);} 
+    header = (octree_header*)base;
+    header->magic = OCTREE_MAGIC;
+    header->version = OCTREE_VERSION;
+    header->format = format;
+    header->nodes = size / node_size(format);
+    root = (octree*)(base + sizeof(octree_header));
+}
+
+/** Reduces the size of the nodes of a file that is opened for writing, discarding the nodes beyond the new size. */
+void octree_file::shrink(uint64_t new_size) {
+    assert(write && new_size <= size && new_size % node_size(format) == 0);
+    uint64_t new_length = new_size + sizeof(octree_header);
+    uint64_t pagesize = getpagesize();
+    uint64_t keep = (new_length + pagesize - 1) & ~(pagesize - 1);
+    if (keep < length) munmap(base + keep, length - keep);
+    size = new_size;
+    length = new_length;
+    header->nodes = size / node_size(format);
+    int ret = ftruncate(fd, length);
+    if (ret) {perror("Could not shrink file"); exit(1);}
+}
+
+/** Computes the FNV-1a hash of the nodes, using 32-bit words instead of bytes for speed. */
+uint32_t octree_file::checksum() const {
+    const uint32_t * data = (const uint32_t *)root;
+    uint32_t hash = 2166136261u;
+    for (uint64_t i = 0; i < size/4; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/** Returns true if the file has no header or if the nodes match the checksum in the header. 
+ * This reads the whole file.
+ */
+bool octree_file::verify() const {
+    return !header || header->checksum == checksum();
 }
 
 octree_file::~octree_file() {
-    if (root!=MAP_FAILED)
-        munmap(root, size);
+    if (base!=MAP_FAILED) {
+        if (write) header->checksum = checksum();
+        munmap(base, length);
+    }
     if (fd!=-1)
         close(fd);
 }
@@ -0,0 +1,159 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "octree_order.h"
+
+namespace {
+    const uint64_t NONE = ~0ull;
+    /** Height of a node whose height is being computed, which is found again below it if the octree contains a cycle. */
+    const uint8_t IN_PROGRESS = 0xff;
+
+    template<typename N>
+    struct orderer {
+        const N * root;
+        std::vector<uint64_t> & sequence;
+        std::vector<uint64_t> index;
+        std::vector<uint8_t> height;
+        std::vector<uint8_t> done;
+
+        orderer(const N * root, uint64_t nodes, std::vector<uint64_t> & sequence) : 
+            root(root), sequence(sequence), index(nodes, NONE), height(nodes, 0), done(nodes, 0) {}
+
+        void emit(uint64_t node) {
+            if (index[node] != NONE) return;
+            index[node] = sequence.size();
+            sequence.push_back(node);
+        }
+
+        /** Returns the number of layers of nodes in the subtree of the given node, or -1 if it contains a cycle. */
+        int compute_height(uint64_t node) {
+            if (height[node] == IN_PROGRESS) return -1;
+            if (!height[node]) {
+                height[node] = IN_PROGRESS;
+                int h = 0;
+                for (int i=0; i<8; i++) {
+                    if (~root[node].child[i]) {
+                        int c = compute_height(root[node].child[i]);
+                        if (c < 0) return -1;
+                        h = std::max(h, c);
+                    }
+                }
+                height[node] = h + 1;
+            }
+            return height[node];
+        }
+
+        void depth_first(uint64_t node) {
+            if (index[node] != NONE) return;
+            emit(node);
+            for (int i=0; i<8; i++) {
+                if (~root[node].child[i]) depth_first(root[node].child[i]);
+            }
+        }
+
+        /** Stores the top h layers of the subtree of the given node in van Emde Boas order. 
+         * The top half of the layers is stored first, followed by each of the subtrees below it.
+         */
+        void van_emde_boas(uint64_t node, int h) {
+            bool complete = h >= height[node];
+            if (complete && done[node]) return;
+            if (h == 1) {
+                emit(node);
+            } else {
+                int top = h/2;
+                van_emde_boas(node, top);
+                // Collect the distinct nodes that are top layers below the given node.
+                std::vector<uint64_t> level(1, node), next;
+                for (int d=0; d<top; d++) {
+                    next.clear();
+                    for (uint64_t j=0; j<level.size(); j++) {
+                        for (int i=0; i<8; i++) {
+                            if (~root[level[j]].child[i]) next.push_back(root[level[j]].child[i]);
+                        }
+                    }
+                    std::sort(next.begin(), next.end());
+                    next.erase(std::unique(next.begin(), next.end()), next.end());
+                    level.swap(next);
+                }
+                for (uint64_t j=0; j<level.size(); j++) {
+                    van_emde_boas(level[j], h - top);
+                }
+            }
+            if (complete) done[node] = 1;
+        }
+    };
+
+    template<typename N>
+    octree_order compute_order(const N * root, uint64_t nodes, octree_order order, std::vector<uint64_t> & sequence) {
+        sequence.clear();
+        orderer<N> o(root, nodes, sequence);
+        int height = order == OCTREE_ORDER_VEB ? o.compute_height(0) : -1;
+        if (height > 0) {
+            o.van_emde_boas(0, height);
+            return OCTREE_ORDER_VEB;
+        }
+        // Cyclic octrees, such as repeated models, have no van Emde Boas order.
+        if (order == OCTREE_ORDER_VEB) fprintf(stderr, "The octree contains a cycle, its nodes are stored in depth first order instead.\n");
+        o.depth_first(0);
+        return OCTREE_ORDER_DEPTH_FIRST;
+    }
+
+    template<typename N>
+    void copy_reordered(const N * in, uint64_t nodes, const std::vector<uint64_t> & sequence, N * out) {
+        std::vector<uint64_t> index(nodes, NONE);
+        for (uint64_t j=0; j<sequence.size(); j++) {
+            index[sequence[j]] = j;
+        }
+        for (uint64_t j=0; j<sequence.size(); j++) {
+            N n = in[sequence[j]];
+            for (int i=0; i<8; i++) {
+                if (~n.child[i]) n.child[i] = index[n.child[i]];
+            }
+            out[j] = n;
+        }
+    }
+}
+
+octree_order order_nodes(const octree * root, uint64_t nodes, octree_order order, std::vector<uint64_t> & sequence) {
+    return compute_order(root, nodes, order, sequence);
+}
+
+octree_order order_nodes(const wide_octree * root, uint64_t nodes, octree_order order, std::vector<uint64_t> & sequence) {
+    return compute_order(root, nodes, order, sequence);
+}
+
+void reorder_nodes(const octree * in, uint64_t nodes, const std::vector<uint64_t> & sequence, octree * out) {
+    copy_reordered(in, nodes, sequence, out);
+}
+
+void reorder_nodes(const wide_octree * in, uint64_t nodes, const std::vector<uint64_t> & sequence, wide_octree * out) {
+    copy_reordered(in, nodes, sequence, out);
+}
+
+octree_order parse_order(const char * name) {
+    if (strcmp(name, "dfs") == 0) return OCTREE_ORDER_DEPTH_FIRST;
+    if (strcmp(name, "veb") == 0) return OCTREE_ORDER_VEB;
+    fprintf(stderr, "Unknown node order '%s', expected 'dfs' or 'veb'.\n", name);
+    exit(2);
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
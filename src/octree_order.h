@@ -0,0 +1,42 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_ORDER_H
+#define OCTREE_ORDER_H
+#include <stdint.h>
+#include <vector>
+#include "octree.h"
+
+/**
+ * Computes a locality preserving order of the nodes that are reachable from the root, 
+ * such that the nodes that are visited after each other during traversal are stored close together.
+ * The sequence receives the old indices of the nodes in their new order, starting with the root.
+ * Nodes that are shared by several parents are stored once.
+ * Returns the order that was used, which is depth first for octrees with a cycle, as they have no van Emde Boas order.
+ */
+octree_order order_nodes(const octree * root, uint64_t nodes, octree_order order, std::vector<uint64_t> & sequence);
+octree_order order_nodes(const wide_octree * root, uint64_t nodes, octree_order order, std::vector<uint64_t> & sequence);
+
+/** Copies the nodes in the order given by the sequence from in to out, updating the child indices. */
+void reorder_nodes(const octree * in, uint64_t nodes, const std::vector<uint64_t> & sequence, octree * out);
+void reorder_nodes(const wide_octree * in, uint64_t nodes, const std::vector<uint64_t> & sequence, wide_octree * out);
+
+/** Returns the order with the given name, which is either 'dfs' or 'veb', or exits if the name is unknown. */
+octree_order parse_order(const char * name);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include "octree_pack.h"
+
+void pack_block(const octree * nodes, uint32_t count, uint64_t first, std::vector<uint8_t> & out) {
+    uint64_t prev = first;
+    for (uint32_t n=0; n<count; n++) {
+        const octree & s = nodes[n];
+        uint32_t mask = 0;
+        for (int i=0; i<8; i++) {
+            if (~s.child[i]) mask |= 1<<i;
+            if (s.avgcolor[i]>=0) mask |= 0x100<<i;
+        }
+        out.push_back((uint8_t)mask);
+        out.push_back((uint8_t)(mask>>8));
+        for (int i=0; i<8; i++) {
+            if (~s.child[i]) {
+                int64_t delta = (int64_t)s.child[i] - (int64_t)prev;
+                uint64_t v = delta<0 ? ~(uint64_t)delta<<1|1 : (uint64_t)delta<<1;
+                while (v>=0x80) {
+                    out.push_back((uint8_t)(v|0x80));
+                    v>>=7;
+                }
+                out.push_back((uint8_t)v);
+                prev = s.child[i];
+            }
+        }
+        for (int i=0; i<8; i++) {
+            if (s.avgcolor[i]>=0) {
+                assert(s.avgcolor[i]<0x1000000);
+                out.push_back((uint8_t)s.avgcolor[i]);
+                out.push_back((uint8_t)(s.avgcolor[i]>>8));
+                out.push_back((uint8_t)(s.avgcolor[i]>>16));
+            }
+        }
+    }
+}
+
+/** Decodes the count nodes of a block that is stored in size bytes, whose first node has index first.
+ * Returns false if the block does not fit in its bytes or refers to nodes beyond total, the number of nodes of the file.
+ */
+bool unpack_block(const uint8_t * data, uint64_t size, uint32_t count, uint64_t first, uint64_t total, octree * nodes) {
+    const uint8_t * end = data + size;
+    uint64_t prev = first;
+    for (uint32_t n=0; n<count; n++) {
+        octree & s = nodes[n];
+        if (end - data < 2) return false;
+        uint32_t mask = data[0] | data[1]<<8;
+        data += 2;
+        for (int i=0; i<8; i++) {
+            if (mask>>i&1) {
+                uint64_t v = 0;
+                int shift = 0;
+                while (data < end && *data&0x80) {
+                    if (shift > 56) return false;
+                    v |= (uint64_t)(*data++&0x7f)<<shift;
+                    shift += 7;
+                }
+                if (data == end) return false;
+                v |= (uint64_t)*data++<<shift;
+                prev += v&1 ? ~(v>>1) : v>>1;
+                if (prev >= total) return false;
+                s.child[i] = prev;
+            } else {
+                s.child[i] = ~0u;
+            }
+        }
+        for (int i=0; i<8; i++) {
+            if (mask>>(8+i)&1) {
+                if (end - data < 3) return false;
+                s.avgcolor[i] = data[0] | data[1]<<8 | data[2]<<16;
+                data += 3;
+            } else {
+                s.avgcolor[i] = -1;
+            }
+        }
+    }
+    return true;
+}
+
+/** Writes the given octree as a packed octree file. 
+ * The description of the octree in the header is copied from the given header.
+ */
+void write_packed(const octree * root, uint64_t nodes, const octree_header & header, const char * filename) {
+    uint64_t blocks = (nodes + PACK_BLOCK_NODES - 1) / PACK_BLOCK_NODES;
+    std::vector<uint64_t> index(blocks+1);
+    std::vector<uint8_t> data;
+    for (uint64_t b=0; b<blocks; b++) {
+        index[b] = (blocks+1)*8 + data.size();
+        uint64_t first = b*PACK_BLOCK_NODES;
+        pack_block(root+first, std::min<uint64_t>(PACK_BLOCK_NODES, nodes-first), first, data);
+    }
+    index[blocks] = (blocks+1)*8 + data.size();
+    // Pad to a multiple of 8 bytes, as required for the checksum.
+    while (data.size()%8) data.push_back(0);
+    
+    octree_file out(filename, (blocks+1)*8 + data.size(), OCTREE_PACKED);
+    octree_header & h = *out.header;
+    h.nodes = nodes;
+    h.block_nodes = PACK_BLOCK_NODES;
+    h.depth = header.depth;
+    h.bottom_layer = header.bottom_layer;
+    h.order = header.order;
+    h.mix = header.mix;
+    memcpy(h.bounds, header.bounds, sizeof(h.bounds));
+    memcpy(h.layer_offset, header.layer_offset, sizeof(h.layer_offset));
+    memcpy(h.layer_count, header.layer_count, sizeof(h.layer_count));
+    memcpy(out.block_index, &index[0], (blocks+1)*8);
+    memcpy((uint8_t*)out.block_index + (blocks+1)*8, &data[0], data.size());
+}
+
+block_cache::block_cache() : hits(0), misses(0), capacity(0), block_nodes(0), data(NULL) {
+    resize(1, PACK_BLOCK_NODES);
+}
+
+block_cache::~block_cache() {
+    delete[] data;
+}
+
+/** Sets the number of blocks that can be cached and the number of nodes per block. */
+void block_cache::resize(uint32_t capacity, uint32_t block_nodes) {
+    capacity = std::max(capacity, 1u);
+    if (capacity == this->capacity && block_nodes == this->block_nodes) return;
+    this->capacity = capacity;
+    this->block_nodes = block_nodes;
+    delete[] data;
+    data = new octree[(uint64_t)capacity * block_nodes];
+    clear();
+}
+
+void block_cache::clear() {
+    slots.clear();
+    tag.assign(capacity, ~0ull);
+    prev.assign(capacity, ~0u);
+    next.assign(capacity, ~0u);
+    head = tail = ~0u;
+    used = 0;
+    last_key = ~0ull;
+    last_data = NULL;
+}
+
+/** Moves the given slot to the front of the list of recently used blocks. */
+void block_cache::touch(uint32_t slot) {
+    if (slot == head) return;
+    if (~prev[slot]) next[prev[slot]] = next[slot];
+    if (~next[slot]) prev[next[slot]] = prev[slot];
+    if (slot == tail) tail = prev[slot];
+    prev[slot] = ~0u;
+    next[slot] = head;
+    if (~head) prev[head] = slot;
+    head = slot;
+    if (!~tail) tail = slot;
+}
+
+/** Returns the given node of the given packed octree file, decompressing its block if necessary. 
+ * The returned node remains valid until its block is evicted.
+ */
+const octree * block_cache::get(const octree_file * file, uint64_t node) {
+    uint32_t file_nodes = file->header->block_nodes;
+    if (file_nodes > block_nodes) resize(capacity, file_nodes);
+    uint64_t block = node / file_nodes;
+    // Packed files have 32-bit node indices, hence the block fits in the lower half of the key.
+    uint64_t key = (uint64_t)file->id << 32 | block;
+    if (key == last_key) {
+        hits++;
+        return last_data + node % file_nodes;
+    }
+    
+    uint32_t slot;
+    std::unordered_map<uint64_t, uint32_t>::iterator it = slots.find(key);
+    if (it != slots.end()) {
+        hits++;
+        slot = it->second;
+    } else {
+        misses++;
+        if (used < capacity) {
+            slot = used++;
+        } else {
+            slot = tail;
+            slots.erase(tag[slot]);
+        }
+        tag[slot] = key;
+        slots[key] = slot;
+        uint64_t first = block * file_nodes;
+        // The end of the last block was checked when the file was opened, that of the other blocks is checked here.
+        uint64_t begin = file->block_index[block], end = file->block_index[block+1];
+        const uint8_t * packed = (const uint8_t *)file->block_index + begin;
+        if (begin > end || end > file->size || !unpack_block(packed, end - begin, 
+                std::min<uint64_t>(file_nodes, file->header->nodes - first), first, file->header->nodes, data + (uint64_t)slot * block_nodes)) {
+            fprintf(stderr, "Block %lu of the packed octree file is corrupt.\n", block);
+            exit(1);
+        }
+    }
+    touch(slot);
+    last_key = key;
+    last_data = data + (uint64_t)slot * block_nodes;
+    return last_data + node % file_nodes;
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
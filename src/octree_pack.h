@@ -0,0 +1,73 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_PACK_H
+#define OCTREE_PACK_H
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include "octree.h"
+
+/** Number of nodes in a block of a packed octree file. */
+static const uint32_t PACK_BLOCK_NODES = 256;
+
+/** 
+ * Packed octree files store blocks of octree nodes, which are compressed independently. 
+ * After the header follows the block index, which contains the offset of every block and 
+ * the end of the last block, relative to the start of the index.
+ * 
+ * Every node is stored as a 16-bit mask of the child indices (bits 0-7) and colors (bits 8-15) 
+ * that are present, followed by the present child indices and colors. Child indices are stored 
+ * as the zigzag varint encoded difference with the previous child index in the block, 
+ * and colors as 3 bytes.
+ */
+void pack_block(const octree * nodes, uint32_t count, uint64_t first, std::vector<uint8_t> & out);
+bool unpack_block(const uint8_t * data, uint64_t size, uint32_t count, uint64_t first, uint64_t total, octree * nodes);
+void write_packed(const octree * root, uint64_t nodes, const octree_header & header, const char * filename);
+
+/**
+ * Cache of decompressed blocks of packed octree files.
+ * Blocks are identified by the id of their file and their index, such that the blocks of 
+ * the files of a scene share the cache. Every slot holds block_nodes nodes, which must be at least
+ * the number of nodes per block of the files. If full, the least recently used block is evicted.
+ * A cache must only be used by a single thread.
+ */
+struct block_cache {
+    uint64_t hits;
+    uint64_t misses;
+    block_cache();
+    ~block_cache();
+    void resize(uint32_t capacity, uint32_t block_nodes);
+    const octree * get(const octree_file * file, uint64_t node);
+private:
+    uint32_t capacity;
+    uint32_t block_nodes;
+    octree * data;
+    std::vector<uint64_t> tag;
+    std::vector<uint32_t> prev, next;
+    std::unordered_map<uint64_t, uint32_t> slots;
+    uint32_t head, tail, used;
+    uint64_t last_key;
+    const octree * last_data;
+    void clear();
+    void touch(uint32_t slot);
+    block_cache(block_cache &);
+    block_cache& operator=(block_cache&);
+};
+
+#endif
@@ -0,0 +1,170 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "octree_page.h"
+
+/** Creates a pager for the nodes of the given file, which keeps at most budget bytes of them resident. */
+octree_pager::octree_pager(const octree_file * file, uint64_t budget) :
+    loaded(0), size(file->size), used(0), hand(0), frames(0), quit(false)
+{
+    fd = dup(file->fd);
+    if (fd == -1) {perror("Could not duplicate file descriptor"); exit(1);}
+    length = lseek(fd, 0, SEEK_END);
+    base = (char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {perror("Could not map file to memory"); exit(1);}
+    nodes = base + (length - size);
+
+    page_nodes = std::max(OCTREE_PAGE_SIZE / octree_file::node_size(file->format), 1u);
+    page_bytes = page_nodes * octree_file::node_size(file->format);
+    pages = (size + page_bytes - 1) / page_bytes;
+    capacity = std::max<uint64_t>(budget / page_bytes, 2);
+    state = new uint8_t[pages]();
+    referenced = new uint8_t[pages]();
+    eviction = new uint64_t[pages]();
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+
+    // The root must always be available.
+    load(0);
+    if (pthread_create(&thread, NULL, run, this)) {
+        perror("Could not create page loader thread");
+        exit(1);
+    }
+}
+
+octree_pager::~octree_pager() {
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+    delete[] state;
+    delete[] referenced;
+    delete[] eviction;
+    munmap(base, length);
+    close(fd);
+}
+
+/** Queues the given page for loading, unless another thread did so already. */
+void octree_pager::request(uint64_t page) {
+    uint8_t expected = PAGE_MISSING;
+    if (!__atomic_compare_exchange_n(&state[page], &expected, PAGE_REQUESTED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&lock);
+    queue.push_back(page);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+/** Reads the given page into memory, evicting another page if the budget is exceeded. */
+void octree_pager::load(uint64_t page) {
+    while (used >= capacity) evict();
+    uint64_t begin = page * page_bytes;
+    uint64_t end = std::min(begin + page_bytes, size);
+    uint64_t pagesize = getpagesize();
+
+    // Fault in every page of the mapping that overlaps with the page.
+    char * first = (char*)((uintptr_t)(nodes + begin) & ~(pagesize-1));
+    madvise(first, nodes + end - first, MADV_WILLNEED);
+    volatile char touch;
+    for (const char * p = first; p < nodes + end; p += pagesize) {
+        touch = *p;
+    }
+    (void)touch;
+
+    __atomic_store_n(&referenced[page], 1, __ATOMIC_RELAXED);
+    used++;
+    __atomic_store_n(&state[page], PAGE_RESIDENT, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&loaded, 1, __ATOMIC_RELAXED);
+}
+
+/** Evicts the first page after the clock hand that was not used since the hand last passed it.
+ * Its memory is released by release, once no render thread can be reading it anymore.
+ */
+void octree_pager::evict() {
+    for (;;) {
+        hand = hand+1 < pages ? hand+1 : 1;
+        if (__atomic_load_n(&state[hand], __ATOMIC_RELAXED) != PAGE_RESIDENT) continue;
+        if (__atomic_load_n(&referenced[hand], __ATOMIC_RELAXED)) {
+            __atomic_store_n(&referenced[hand], 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_store_n(&state[hand], PAGE_MISSING, __ATOMIC_RELAXED);
+        used--;
+        eviction[hand] = __atomic_load_n(&frames, __ATOMIC_ACQUIRE);
+        evicted.push_back(std::make_pair(hand, eviction[hand]));
+        return;
+    }
+}
+
+/** Returns true if the frame during which the oldest evicted page was evicted has ended. */
+bool octree_pager::releasable() const {
+    return !evicted.empty() && evicted.front().second < __atomic_load_n(&frames, __ATOMIC_ACQUIRE);
+}
+
+/** Releases the memory of the evicted pages that no render thread can be reading, 
+ * unless they were loaded again or evicted again during a later frame.
+ */
+void octree_pager::release() {
+    uint64_t pagesize = getpagesize();
+    while (releasable()) {
+        uint64_t page = evicted.front().first;
+        uint64_t frame = evicted.front().second;
+        evicted.pop_front();
+        if (__atomic_load_n(&state[page], __ATOMIC_RELAXED) == PAGE_RESIDENT || eviction[page] != frame) continue;
+        // Only release the pages of the mapping that lie entirely within the page, as its neighbours might be resident.
+        uintptr_t begin = ((uintptr_t)(nodes + page * page_bytes) + pagesize - 1) & ~(pagesize-1);
+        uintptr_t end = (uintptr_t)(nodes + std::min((page+1) * page_bytes, size)) & ~(pagesize-1);
+        if (begin < end) madvise((void*)begin, end - begin, MADV_DONTNEED);
+    }
+}
+
+void octree_pager::end_frame() {
+    pthread_mutex_lock(&lock);
+    __atomic_add_fetch(&frames, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+/** Main loop of the loader thread. */
+void * octree_pager::run(void * arg) {
+    octree_pager & p = *(octree_pager*)arg;
+    pthread_mutex_lock(&p.lock);
+    for (;;) {
+        while (p.queue.empty() && !p.quit && !p.releasable()) pthread_cond_wait(&p.wakeup, &p.lock);
+        if (p.quit) break;
+        bool requested = !p.queue.empty();
+        uint64_t page = requested ? p.queue.front() : 0;
+        if (requested) p.queue.pop_front();
+        pthread_mutex_unlock(&p.lock);
+        // Evicted pages are only handled by this thread, hence a page cannot be released while it is loaded again.
+        p.release();
+        if (requested) p.load(page);
+        pthread_mutex_lock(&p.lock);
+    }
+    pthread_mutex_unlock(&p.lock);
+    return NULL;
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
@@ -0,0 +1,97 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_PAGE_H
+#define OCTREE_PAGE_H
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <utility>
+#include "octree.h"
+
+/** Size in bytes of the pages in which the nodes of an octree file are loaded. */
+static const uint32_t OCTREE_PAGE_SIZE = 1<<16;
+
+/**
+ * Loads the pages of the nodes of an octree file on a background thread.
+ * Render threads ask whether the page of a node is resident before visiting it. If not, the page
+ * is queued for loading and the render thread draws the average color of the node instead,
+ * such that it never blocks on a page fault.
+ *
+ * At most capacity pages are kept resident. If more are needed, pages that were not
+ * used since the clock hand last passed them are evicted. The first page,
+ * which contains the root, is loaded when the pager is created and never evicted.
+ *
+ * The pager maps the file itself, such that the loader thread remains valid after the file is closed.
+ * Render threads that found a page resident may still be reading it when it is evicted, hence its memory 
+ * is only released once the frame during which it was evicted has ended, as reported by end_frame.
+ */
+struct octree_pager {
+    uint64_t loaded;     ///< Number of pages loaded since the pager was created.
+    const char * nodes;  ///< The nodes of the file, which must be read through this pointer.
+    octree_pager(const octree_file * file, uint64_t budget);
+    ~octree_pager();
+
+    /** Tells the pager that the render threads finished the current frame, such that the memory of the pages evicted during it can be released. */
+    void end_frame();
+
+    /** Returns true if the page of the given node is resident, and queues it for loading otherwise. */
+    bool resident(uint64_t node) {
+        uint64_t page = node / page_nodes;
+        uint8_t s = __atomic_load_n(&state[page], __ATOMIC_ACQUIRE);
+        if (s == PAGE_RESIDENT) {
+            // The loader thread clears the flag concurrently, the load avoids dirtying the cache line if it is set.
+            if (!__atomic_load_n(&referenced[page], __ATOMIC_RELAXED)) __atomic_store_n(&referenced[page], 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        if (s == PAGE_MISSING) request(page);
+        return false;
+    }
+private:
+    enum {PAGE_MISSING, PAGE_REQUESTED, PAGE_RESIDENT};
+    int fd;
+    char * base;
+    uint64_t length;
+    uint64_t size;
+    uint32_t page_nodes;
+    uint32_t page_bytes;
+    uint64_t pages;
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t hand;
+    uint8_t * state;
+    uint8_t * referenced;
+    uint64_t frames; ///< Number of frames that have ended.
+    uint64_t * eviction; ///< Frame during which each page was last evicted.
+    std::deque<uint64_t> queue;
+    std::deque<std::pair<uint64_t, uint64_t> > evicted; ///< Evicted pages whose memory is not released yet, with the frame during which they were evicted.
+    bool releasable() const;
+    void release();
+    bool quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    void request(uint64_t page);
+    void load(uint64_t page);
+    void evict();
+    static void * run(void * arg);
+    octree_pager(octree_pager &);
+    octree_pager& operator=(octree_pager&);
+};
+
+#endif
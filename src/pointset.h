@@ -34,8 +34,8 @@ struct point {
  */
 struct pointset {
     bool write;
-    uint32_t size; /// Number of bytes in the pointfile.
-    uint32_t length; /// Number of points in the pointfile.
+    uint64_t size; /// Number of bytes in the pointfile.
+    uint64_t length; /// Number of points in the pointfile.
     int32_t fd;
     point * list;
     pointset(const char* filename, bool write=false);
@@ -18,7 +18,6 @@
 
 #include <cstring>
 #include "quadtree.h"
-#include "art.h"
 
 static const unsigned int B[] = {0x00FF00FF, 0x0F0F0F0F, 0x33333333, 0x55555555};
 static const unsigned int S[] = {8, 4, 2, 1};
@@ -34,27 +33,75 @@ void quadtree::set(int x, int y) {
     map[M + (x | (y<<1))] = 1;
 }
 
-void quadtree::set_face(int v, int color) {
+/**
+ * Resets the quadtree, such that it is 0 everywhere
+ */
+quadtree::quadtree() : face(NULL) {
+    memset(map,0,sizeof(map));
+    if (morton_x[1]==0) {
+        for (unsigned int i=0; i<SIZE; i++) {
+            int v = i;
+            for (int j=0; j<4; j++) {
+                v = (v | (v << S[j])) & B[j];
+            }
+            morton_x[i] = v;
+            morton_y[i] = v<<1;
+        }
+    }
+}
+
+/**
+ * Sets all pixels below the given node to the given color.
+ */
+void quadtree::set_block(int v, int color) {
     map[v] = 0;
-    v -= M;
-    int x = v;
-    int y = v>>1;
-    for (int i=3; i>=0; i--) {
-        x &= B[i];
-        y &= B[i];
-        x = (x | (x >> S[i]));
-        y = (y | (y >> S[i]));
+    int n = 1;
+    while (v < (int)M) {
+        v = v*4+4;
+        n *= 4;
+    }
+    for (int i=0; i<n; i++) {
+        face[v-M+i] = color;
     }
-    x &= 0xffff;
-    y &= 0xffff;
-    pixel(x, y, color);
-}    
+}
 
 /**
- * Resets the quadtree, such that it is 0 everywhere
+ * Marks all pixels of the face as unrendered.
  */
-quadtree::quadtree() {
-    memset(map,0,sizeof(map));
+void quadtree::clear_face() {
+    memset(face,-1,SIZE*SIZE*sizeof(int32_t));
+}
+
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+
+static const v4si row_even = {0,1,4,5};
+static const v4si row_odd  = {2,3,6,7};
+
+/**
+ * Converts the face from Morton order to scanlines and writes the rendered pixels to the given buffer.
+ * The face is processed in blocks of 4x4 pixels, which are 16 consecutive values in Morton order.
+ * Width and height must be multiples of 4. The face must be 16-byte aligned.
+ */
+void quadtree::draw(uint32_t * pixels, int width, int height) {
+    for (int y=0; y<height; y+=4) {
+        for (int x=0; x<width; x+=4) {
+            const v4si * block = (const v4si*)(face + (morton_x[x] | morton_y[y]));
+            v4si row[4] = {
+                __builtin_shuffle(block[0], block[1], row_even),
+                __builtin_shuffle(block[0], block[1], row_odd),
+                __builtin_shuffle(block[2], block[3], row_even),
+                __builtin_shuffle(block[2], block[3], row_odd),
+            };
+            for (int i=0; i<4; i++) {
+                uint32_t * target = pixels + (y+i)*width + x;
+                v4si old;
+                __builtin_memcpy(&old, target, sizeof(v4si));
+                v4si unrendered = row[i] < 0;
+                v4si result = (old & unrendered) | (row[i] & ~unrendered);
+                __builtin_memcpy(target, &result, sizeof(v4si));
+            }
+        }
+    }
 }
 
 /** 
@@ -112,5 +159,7 @@ const unsigned int quadtree::N;
 const unsigned int quadtree::M;
 const unsigned int quadtree::L;
 const unsigned int quadtree::SIZE;
+uint32_t quadtree::morton_x[quadtree::SIZE];
+uint32_t quadtree::morton_y[quadtree::SIZE];
 
     
\ No newline at end of file
@@ -36,10 +36,26 @@ struct quadtree {
         uint8_t  map[N];
         uint32_t children[N/4];
     };
+    
+    /**
+     * Colors of the bottom level of the tree, stored in the same (Morton) order as map[M], ..., map[N-1].
+     * Unrendered pixels are set to -1. Can be shared by multiple quadtrees.
+     */
+    int32_t * face;
+    
+    /** The Morton index of pixel (x,y) is morton_x[x] | morton_y[y]. */
+    static uint32_t morton_x[SIZE];
+    static uint32_t morton_y[SIZE];
         
     quadtree();
     void set(int x, int y);
-    void set_face(int v, int color);
+    void set_face(int v, int color) {
+        map[v] = 0;
+        face[v-M] = color;
+    }
+    void set_block(int v, int color);
+    void clear_face();
+    void draw(uint32_t * pixels, int width, int height);
     void compute(unsigned int i);
     void build_fill(unsigned int i);
     void build_check(int width, int height, unsigned int i, int size);
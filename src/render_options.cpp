@@ -0,0 +1,135 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "octree.h"
+#include "scene.h"
+#include "render_options.h"
+
+/**
+ * Parses the command line options that are shared by the tools that render octrees,
+ * setting the render_* and octree_map_options globals and the given options.
+ * Exits on unknown options and on options that cannot be combined. Returns the index of the first argument that is not an option.
+ */
+int render_parse_options(int argc, char ** argv, render_options & options) {
+    options.headless = false;
+    options.composed = false;
+    options.drop_cache = false;
+    options.extension = "oct";
+    options.image = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:Ho:cb:l:L:szSxC:p:m:Pd")) != -1) {
+        switch (opt) {
+            case 't':
+                render_threads = atoi(optarg);
+                if (render_threads <= 0) render_threads = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'H':
+                options.headless = true;
+                break;
+            case 'o':
+                options.image = optarg;
+                break;
+            case 'c':
+                render_cubemap = true;
+                break;
+            case 'b':
+                render_budget = atof(optarg);
+                break;
+            case 'l':
+                render_lod = atof(optarg);
+                break;
+            case 'L':
+                render_lod_distance = atof(optarg);
+                break;
+            case 's':
+                options.extension = "svo";
+                break;
+            case 'z':
+                options.extension = "ocz";
+                break;
+            case 'S':
+                options.extension = "ocs";
+                break;
+            case 'x':
+                options.composed = true;
+                break;
+            case 'C':
+                render_cache = atoi(optarg);
+                break;
+            case 'p':
+                render_paging = atoi(optarg);
+                break;
+            case 'm':
+                octree_map_options = 0;
+                if (strchr(optarg, 'w')) octree_map_options |= OCTREE_WILLNEED;
+                if (strchr(optarg, 'h')) octree_map_options |= OCTREE_HUGEPAGES;
+                if (strchr(optarg, 'p')) octree_map_options |= OCTREE_PRETOUCH;
+                break;
+            case 'P':
+                render_prefetch = false;
+                break;
+            case 'd':
+                options.drop_cache = true;
+                break;
+            default:
+                exit(2);
+        }
+    }
+    // The faces of a cubemap are rendered whole, hence the budget would not be kept.
+    if (render_cubemap && render_budget > 0) {
+        fprintf(stderr, "A time budget (-b) cannot be combined with rendering to a cubemap (-c).\n");
+        exit(2);
+    }
+    return optind;
+}
+
+/** Evicts the file from the page cache, such that it is read from disk when it is rendered. */
+static void drop_cache(int fd) {
+    if (fd != -1) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/** Loads the model with the given name from 'vxl/': the scene 'name.scene' if the options ask for a composed world,
+ * and otherwise the octree file with the extension of the options.
+ */
+scene * render_load(const char * name, const render_options & options) {
+    char infile[strlen(name)+strlen(options.extension)+12];
+    if (options.composed) {
+        sprintf(infile, "vxl/%s.scene", name);
+        scene * world = new scene(infile);
+        // The files of a scene are only known once it has been loaded.
+        if (options.drop_cache) {
+            for (unsigned int i=0; i<world->files.size(); i++) drop_cache(world->files[i]->fd);
+        }
+        return world;
+    }
+    sprintf(infile, "vxl/%s.%s", name, options.extension);
+    if (options.drop_cache) {
+        int fd = open(infile, O_RDONLY);
+        drop_cache(fd);
+        if (fd != -1) close(fd);
+    }
+    return new scene(new octree_file(infile), true);
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle; 
@@ -0,0 +1,35 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDER_OPTIONS_H
+#define RENDER_OPTIONS_H
+#include "scene.h"
+
+/** Options of the tools that render octrees, which are parsed by render_parse_options. */
+struct render_options {
+    bool headless;          ///< Render to an in-memory framebuffer instead of a window.
+    bool composed;          ///< Load a scene description instead of a single octree file.
+    bool drop_cache;        ///< Evict the octree files from the page cache before loading them.
+    const char * extension; ///< Extension of the octree files.
+    const char * image;     ///< File to save the rendered frame to, or NULL.
+};
+
+int render_parse_options(int argc, char ** argv, render_options & options);
+scene * render_load(const char * name, const render_options & options);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "timing.h"
+#include "octree.h"
+#include "octree_order.h"
+
+/* Rewrites an octree file such that the nodes are stored in a locality preserving order.
+ * The result replaces the original file.
+ */
+
+int main(int argc, char ** argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr,"Please specify the file to reorder (without 'vxl/' & '.oct') and optionally the order (dfs or veb).\n");
+    exit(2);
+  }
+  Timer t;
+  octree_order order = argc == 3 ? parse_order(argv[2]) : OCTREE_ORDER_VEB;
+
+  // Determine the file names.
+  char * name = argv[1];
+  int length=strlen(name);
+  char infile[length+9];
+  char outfile[length+13];
+  sprintf(infile, "vxl/%s.oct", name);
+  sprintf(outfile, "vxl/%s.oct.tmp", name);
+  
+  printf("[%10.0f] Opening '%s'.\n", t.elapsed(), infile);
+  octree_file in(infile);
+  if (!in.header) {
+    fprintf(stderr, "Octree files without header cannot be reordered, convert the model again with build_db.\n");
+    exit(1);
+  }
+  if (in.format != OCTREE_NODES && in.format != OCTREE_WIDE) {
+    fprintf(stderr, "Only octree files with 32 or 64-bit child indices can be reordered.\n");
+    exit(1);
+  }
+  if (!in.verify()) {
+    fprintf(stderr, "The checksum in the header does not match the nodes, '%s' is damaged and left unchanged.\n", infile);
+    exit(1);
+  }
+  
+  printf("[%10.0f] Ordering %lu nodes.\n", t.elapsed(), in.nodes());
+  std::vector<uint64_t> sequence;
+  if (in.format == OCTREE_WIDE) {
+    order = order_nodes(in.wide_root, in.nodes(), order, sequence);
+  } else {
+    order = order_nodes(in.root, in.nodes(), order, sequence);
+  }
+  
+  printf("[%10.0f] Writing %lu nodes to '%s'.\n", t.elapsed(), sequence.size(), outfile);
+  {
+    octree_file out(outfile, sequence.size() * octree_file::node_size(in.format), in.format);
+    memcpy(out.header, in.header, sizeof(octree_header));
+    out.header->nodes = sequence.size();
+    out.header->order = order;
+    memset(out.header->layer_offset, 0, sizeof(out.header->layer_offset));
+    if (in.format == OCTREE_WIDE) {
+      reorder_nodes(in.wide_root, in.nodes(), sequence, out.wide_root);
+    } else {
+      reorder_nodes(in.root, in.nodes(), sequence, out.root);
+    }
+  }
+  
+  if (rename(outfile, infile)) {
+    perror("Could not replace the original file");
+    exit(1);
+  }
+  printf("[%10.0f] Done.\n", t.elapsed());
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
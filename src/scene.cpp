@@ -0,0 +1,100 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "scene.h"
+
+static uint32_t scene_count = 0;
+
+/** Parses an orientation such as '+x+y+z', giving the world axis of the x, y and z axes of the octree. 
+ * Returns false if it is not a permutation of the axes.
+ */
+static bool parse_orientation(const char * text, glm::dmat3 & orientation) {
+    if (strlen(text) != 6) return false;
+    int used = 0;
+    for (int j=0; j<3; j++) {
+        char sign = text[j*2], axis = text[j*2+1];
+        if ((sign != '+' && sign != '-') || axis < 'x' || axis > 'z') return false;
+        int a = axis - 'x';
+        if (used & 1<<a) return false;
+        used |= 1<<a;
+        orientation[j] = glm::dvec3(0);
+        orientation[j][a] = sign == '+' ? 1 : -1;
+    }
+    return true;
+}
+
+/** Loads the scene description with the given file name and the octree files that it refers to. */
+scene::scene(const char * filename) : id(++scene_count), owner(true) {
+    FILE * f = fopen(filename, "r");
+    if (!f) {perror("Could not open scene"); exit(1);}
+    std::vector<char *> names;
+    char line[1024];
+    int number = 0;
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        char name[256], axes[16] = "+x+y+z";
+        double x, y, z;
+        if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#') continue;
+        int n = sscanf(line, "%255s %lf %lf %lf %15s", name, &x, &y, &z, axes);
+        scene_instance instance;
+        if (n < 4 || !parse_orientation(axes, instance.orientation)) {
+            fprintf(stderr, "%s:%d: Expected a file name, offset and optionally an orientation such as '+x+y+z'.\n", filename, number);
+            exit(1);
+        }
+        instance.offset = glm::dvec3(x, y, z);
+        instance.file = NULL;
+        for (unsigned int i=0; i<names.size(); i++) {
+            if (strcmp(names[i], name) == 0) instance.file = files[i];
+        }
+        if (!instance.file) {
+            char path[strlen(name)+5];
+            sprintf(path, "vxl/%s", name);
+            instance.file = new octree_file(path);
+            files.push_back(instance.file);
+            names.push_back(strdup(name));
+        }
+        instances.push_back(instance);
+    }
+    fclose(f);
+    for (unsigned int i=0; i<names.size(); i++) free(names[i]);
+    if (instances.empty()) {
+        fprintf(stderr, "Scene '%s' is empty.\n", filename);
+        exit(1);
+    }
+}
+
+/** Creates a scene with a single instance of the given file, which is closed by the scene if owner is set. */
+scene::scene(octree_file * file, bool owner) : id(++scene_count), owner(owner) {
+    scene_instance instance;
+    instance.file = file;
+    instance.offset = glm::dvec3(0);
+    instance.orientation = glm::dmat3(1);
+    files.push_back(file);
+    instances.push_back(instance);
+}
+
+scene::~scene() {
+    if (owner) {
+        for (unsigned int i=0; i<files.size(); i++) delete files[i];
+    }
+}
+
+// kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle;
@@ -0,0 +1,62 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2013  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCENE_H
+#define SCENE_H
+#include <vector>
+#include <glm/glm.hpp>
+#include "octree.h"
+
+/** An octree placed in the world. 
+ * A point p of the octree is drawn at orientation*p + offset, where orientation 
+ * permutes and flips the axes, such that the octree remains aligned with the axes.
+ */
+struct scene_instance {
+    octree_file * file;
+    glm::dvec3 offset;
+    glm::dmat3 orientation;
+};
+
+/**
+ * A world composed of instances of octree files, which are drawn in a single pass by octree_draw.
+ * Every file is loaded once, however often it is instanced. Instances should not overlap.
+ * 
+ * The scene description contains one instance per line, given by the name of its file in 'vxl/', 
+ * including the extension, followed by its offset and optionally its orientation, 
+ * which gives the world axis of its x, y and z axes, for example: 
+ * 
+ *     sign.oct  134217728 0 0  -z+y+x
+ * 
+ * Empty lines and lines starting with '#' are ignored.
+ */
+struct scene {
+    std::vector<octree_file*> files;
+    std::vector<scene_instance> instances;
+    uint32_t id; ///< Unique for every loaded scene.
+    scene(const char * filename);
+    explicit scene(octree_file * file, bool owner = false);
+    ~scene();
+private:
+    bool owner;
+    scene(scene &);
+    scene& operator=(scene&);
+};
+
+void octree_draw(const scene & s);
+
+#endif